@@ -59,6 +59,7 @@ struct omap_mbox {
 	void			*priv;
 	int			use_count;
 	struct blocking_notifier_head   notifier;
+	struct atomic_notifier_head	irq_notifier;
 };
 
 int omap_mbox_msg_send(struct omap_mbox *, mbox_msg_t msg);
@@ -67,6 +68,10 @@ void omap_mbox_init_seq(struct omap_mbox *);
 struct omap_mbox *omap_mbox_get(const char *, struct notifier_block *nb);
 void omap_mbox_put(struct omap_mbox *mbox, struct notifier_block *nb);
 
+int omap_mbox_irq_register(struct omap_mbox *mbox, struct notifier_block *nb);
+int omap_mbox_irq_unregister(struct omap_mbox *mbox,
+						struct notifier_block *nb);
+
 int omap_mbox_register(struct device *parent, struct omap_mbox **);
 int omap_mbox_unregister(void);
 
@@ -175,7 +175,8 @@ static void __mbox_rx_interrupt(struct omap_mbox *mbox)
 {
 	struct omap_mbox_queue *mq = mbox->rxq;
 	mbox_msg_t msg;
-	int len;
+	bool queued = false;
+	int len, ret;
 
 	while (!mbox_fifo_empty(mbox)) {
 		if (unlikely(kfifo_avail(&mq->fifo) < sizeof(msg))) {
@@ -186,8 +187,15 @@ static void __mbox_rx_interrupt(struct omap_mbox *mbox)
 
 		msg = mbox_fifo_read(mbox);
 
-		len = kfifo_in(&mq->fifo, (unsigned char *)&msg, sizeof(msg));
-		WARN_ON(len != sizeof(msg));
+		/* the fast handlers get the first go, right here */
+		ret = atomic_notifier_call_chain(&mbox->irq_notifier,
+						sizeof(msg), (void *)msg);
+		if (!(ret & NOTIFY_STOP_MASK)) {
+			len = kfifo_in(&mq->fifo, (unsigned char *)&msg,
+								sizeof(msg));
+			WARN_ON(len != sizeof(msg));
+			queued = true;
+		}
 
 		if (mbox->ops->type == OMAP_MBOX_TYPE1)
 			break;
@@ -195,6 +203,8 @@ static void __mbox_rx_interrupt(struct omap_mbox *mbox)
 
 	/* no more messages in the fifo. clear IRQ source. */
 	ack_mbox_irq(mbox, IRQ_RX);
+	if (!queued)
+		return;
 nomem:
 	schedule_work(&mbox->rxq->work);
 }
@@ -355,6 +365,28 @@ void omap_mbox_put(struct omap_mbox *mbox, struct notifier_block *nb)
 }
 EXPORT_SYMBOL(omap_mbox_put);
 
+/*
+ * Fast RX handlers are called directly from the mailbox interrupt, for
+ * every incoming message, before it is queued for the (blocking) notifiers
+ * registered with omap_mbox_get(). This saves a trip through the system
+ * workqueue. A handler which consumes the message returns NOTIFY_STOP, and
+ * the message then goes no further. Handlers must not sleep.
+ *
+ * The mailbox must have been acquired with omap_mbox_get() beforehand.
+ */
+int omap_mbox_irq_register(struct omap_mbox *mbox, struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&mbox->irq_notifier, nb);
+}
+EXPORT_SYMBOL(omap_mbox_irq_register);
+
+int omap_mbox_irq_unregister(struct omap_mbox *mbox,
+						struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&mbox->irq_notifier, nb);
+}
+EXPORT_SYMBOL(omap_mbox_irq_unregister);
+
 static struct class omap_mbox_class = { .name = "mbox", };
 
 int omap_mbox_register(struct device *parent, struct omap_mbox **list)
@@ -376,6 +408,7 @@ int omap_mbox_register(struct device *parent, struct omap_mbox **list)
 		}
 
 		BLOCKING_INIT_NOTIFIER_HEAD(&mbox->notifier);
+		ATOMIC_INIT_NOTIFIER_HEAD(&mbox->irq_notifier);
 	}
 	return 0;
 
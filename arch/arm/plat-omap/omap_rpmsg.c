@@ -15,6 +15,8 @@
 #define pr_fmt(fmt) "%s: " fmt, __func__
 
 #include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/bootmem.h>
 #include <linux/virtio.h>
 #include <linux/virtio_config.h>
@@ -26,11 +28,19 @@
 #include <linux/slab.h>
 #include <linux/notifier.h>
 #include <linux/memblock.h>
+#include <linux/log2.h>
+#include <linux/cache.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
 #include <asm/io.h>
+#include <asm/cacheflush.h>
+#include <asm/outercache.h>
 
 #include <plat/mailbox.h>
 #include <plat/remoteproc.h>
 
+#include <trace/events/rpmsg.h>
+
 /*
  * enum - Predefined Mailbox Messages
  *
@@ -66,16 +76,19 @@ enum {
 
 struct omap_rpmsg_device {
 	struct virtio_device vdev;
-	unsigned int vring[2]; /* A9 owns first vring, M3-core0 owns the 2nd */
+	/* RX then TX vring of each pair; A9 owns the RX ones, M3 the TX ones */
+	unsigned int vring[2 * RPMSG_MAX_VQ_PAIRS];
 	unsigned int buf_addr;
-	unsigned int buf_size; /* must be page-aligned */
+	unsigned int buf_size; /* must be page-aligned, set at init */
 	void *buf_mapped;
+	bool buf_cached;
 	char *mbox_name;
 	char *rproc_name;
 	struct omap_mbox *mbox;
 	struct omap_rproc *rproc;
 	struct notifier_block nb;
-	struct virtqueue *vq[2];
+	struct notifier_block irq_nb;
+	struct virtqueue *vq[2 * RPMSG_MAX_VQ_PAIRS];
 	int id;
 	int base_vq_id;
 	int num_of_vqs;
@@ -88,18 +101,71 @@ struct omap_rpmsg_vq_info {
 	__u16 vq_id;	/* a globaly unique index of this virtqueue */
 	void *addr;	/* address where we mapped the virtio ring */
 	struct omap_rpmsg_device *rpdev;
+	/* kick coalescing, see omap_rpmsg_notify() */
+	spinlock_t kick_lock;
+	struct tasklet_hrtimer kick_timer;
+	ktime_t last_kick;
+	bool kick_pending;
 };
 
 /*
- * For now, allocate 256 buffers of 512 bytes for each side. each buffer
+ * By default, allocate 256 buffers of 512 bytes for each side. each buffer
  * will have 16B for the msg header and 496B for the payload.
  * This will require a total space of 256KB for the buffers themselves, and
  * 3 pages for every vring (the size of the vring depends on the number of
  * buffers it supports).
+ *
+ * The number and size of the buffers can be changed (independently for
+ * each direction) using the module parameters below. The RX buffers come
+ * first, followed by the TX buffers, and then by the RX and TX vrings,
+ * each starting on a page boundary. Note that this layout is part of the
+ * "wire" protocol: the remote firmware must be configured the same way.
+ *
+ * The buffers can also be spread over several pairs of vrings, which
+ * are then laid out as RX0, TX0, RX1, TX1, ... Each pair has its own
+ * share of the buffers, and the pairs are kicked independently (each
+ * vring has its own mailbox id), so concurrent senders don't contend.
+ */
+static unsigned int rx_bufs = 256;
+module_param(rx_bufs, uint, S_IRUGO);
+MODULE_PARM_DESC(rx_bufs, "Number of RX buffers (power of 2)");
+
+static unsigned int tx_bufs = 256;
+module_param(tx_bufs, uint, S_IRUGO);
+MODULE_PARM_DESC(tx_bufs, "Number of TX buffers (power of 2)");
+
+static unsigned int rx_buf_size = 512;
+module_param(rx_buf_size, uint, S_IRUGO);
+MODULE_PARM_DESC(rx_buf_size, "Size of each RX buffer, header included");
+
+static unsigned int tx_buf_size = 512;
+module_param(tx_buf_size, uint, S_IRUGO);
+MODULE_PARM_DESC(tx_buf_size, "Size of each TX buffer, header included");
+
+static unsigned int vq_pairs = 1;
+module_param(vq_pairs, uint, S_IRUGO);
+MODULE_PARM_DESC(vq_pairs, "Number of RX/TX vring pairs (power of 2)");
+
+/*
+ * The first pair of vrings can be dedicated to high priority (e.g. control)
+ * messages, which then don't have to wait behind bulk traffic. The remote
+ * firmware must then service that pair first, too.
+ */
+static bool prio_lane;
+module_param(prio_lane, bool, S_IRUGO);
+MODULE_PARM_DESC(prio_lane, "Dedicate the first vring pair to urgent messages");
+
+/*
+ * With event indices, each side publishes in the vrings the exact index it
+ * wants to be notified about, instead of an on/off flag, which saves most
+ * of the mailbox interrupts under load. The firmware must support it too.
  */
-#define RP_MSG_NUM_BUFS		(512)
-#define RP_MSG_BUF_SIZE		(512)
-#define RP_MSG_BUFS_SPACE	(RP_MSG_NUM_BUFS * RP_MSG_BUF_SIZE)
+static bool event_idx;
+module_param(event_idx, bool, S_IRUGO);
+MODULE_PARM_DESC(event_idx, "Offer event index notification suppression");
+
+#define RP_MSG_MIN_BUF_SIZE	(64)
+#define RP_MSG_MAX_BUF_SIZE	(64 * 1024)
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -107,20 +173,88 @@ struct omap_rpmsg_vq_info {
  * to update your BIOS image as well
  */
 #define RP_MSG_VRING_ALIGN	(4096)
-/* With 256 buffers, our vring will occupy 3 pages */
-#define RP_MSG_RING_SIZE	((DIV_ROUND_UP(vring_size(RP_MSG_NUM_BUFS/2, \
-				RP_MSG_VRING_ALIGN), PAGE_SIZE)) * PAGE_SIZE)
+
+/* the space occupied by a vring of @num buffers (3 pages for 256 buffers) */
+#define RP_MSG_RING_SIZE(num)	PAGE_ALIGN(vring_size(num, RP_MSG_VRING_ALIGN))
 
 /*
  * using statically defined memory regions for now.
  * requires something like mem=456M@0x80000000 mem=512M@0xA0000000
  */
 #define CORE0_BUFS_PHYS		(DUCATI_BASEIMAGE_PHYSICAL_ADDRESS)
-#define CORE0_VRING0_PHYS	(CORE0_BUFS_PHYS + RP_MSG_BUFS_SPACE)
-#define CORE0_VRING1_PHYS	(CORE0_VRING0_PHYS + 0x3000)
 #define CORE1_BUFS_PHYS		(DUCATI_BASEIMAGE_PHYSICAL_ADDRESS + 0x50000)
-#define CORE1_VRING0_PHYS	(CORE1_BUFS_PHYS + RP_MSG_BUFS_SPACE)
-#define CORE1_VRING1_PHYS	(CORE1_VRING0_PHYS + 0x3000)
+/* buffers and vrings of a core must fit in its region */
+#define RP_MSG_REGION_SIZE	(0x50000)
+
+/*
+ * Message buffers are mapped uncached by default, which makes every access
+ * to them (header updates, memcpy of payloads) very slow. Alternatively,
+ * they can be mapped cacheable, and then the rpmsg core explicitly cleans
+ * and invalidates the parts of each buffer it hands over or receives.
+ * The vrings themselves are always left uncached.
+ */
+static bool cached_bufs;
+module_param(cached_bufs, bool, S_IRUGO);
+MODULE_PARM_DESC(cached_bufs, "Map the message buffers cacheable");
+
+/*
+ * The remote processor looks at the whole vring whenever it gets a kick,
+ * so several kicks of the same vring in a row are redundant, yet each of
+ * them takes a slot in the (4-deep) mailbox FIFO. A kick that comes less
+ * than kick_delay_us after the previous one of its vring is therefore
+ * postponed until that delay has elapsed, and any other kick arriving in
+ * the meantime is merged into it. The first kick after a quiet period
+ * still goes out right away. Set to 0 to send every kick immediately.
+ */
+static unsigned int kick_delay_us = 20;
+module_param(kick_delay_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(kick_delay_us, "Max delay used to merge vring kicks (usecs)");
+
+/*
+ * Vring kicks from the remote processor are handled right in the mailbox
+ * interrupt by default, rather than in the mailbox workqueue: this saves
+ * a context switch and an unbounded scheduling delay on every inbound
+ * message. Other mailbox messages still go through the workqueue.
+ */
+static bool irq_rx = true;
+module_param(irq_rx, bool, S_IRUGO);
+MODULE_PARM_DESC(irq_rx, "Handle vring kicks in the mailbox interrupt");
+
+static unsigned long omap_rpmsg_buf_pa(struct omap_rpmsg_device *rpdev,
+								void *va)
+{
+	return rpdev->buf_addr + (va - rpdev->buf_mapped);
+}
+
+static void omap_rpmsg_clean_buf(struct virtio_device *vdev, void *va,
+								size_t len)
+{
+	struct omap_rpmsg_device *rpdev = to_omap_rpdev(vdev);
+	unsigned long pa = omap_rpmsg_buf_pa(rpdev, va);
+
+	/* inner cache first, so its dirty lines make it to the outer one */
+	__cpuc_flush_dcache_area(va, len);
+	outer_clean_range(pa, pa + len);
+}
+
+static void omap_rpmsg_inv_buf(struct virtio_device *vdev, void *va,
+								size_t len)
+{
+	struct omap_rpmsg_device *rpdev = to_omap_rpdev(vdev);
+	unsigned long pa = omap_rpmsg_buf_pa(rpdev, va);
+
+	/*
+	 * outer cache first, so the inner one can't refill with stale data.
+	 * we never write to RX buffers, so there's nothing dirty to flush
+	 */
+	outer_inv_range(pa, pa + len);
+	__cpuc_flush_dcache_area(va, len);
+}
+
+static struct rpmsg_cache_ops omap_rpmsg_cache_ops = {
+	.clean	= omap_rpmsg_clean_buf,
+	.inv	= omap_rpmsg_inv_buf,
+};
 
 /* provide drivers with platform-specific details */
 static void omap_rpmsg_get(struct virtio_device *vdev, unsigned int request,
@@ -128,7 +262,8 @@ static void omap_rpmsg_get(struct virtio_device *vdev, unsigned int request,
 {
 	struct omap_rpmsg_device *rpdev = to_omap_rpdev(vdev);
 	void *base;
-	int num_bufs, buf_size;
+	struct rpmsg_cache_ops *ops;
+	int num_bufs, buf_size, val;
 
 	/* todo: remove WARN_ON, do sane length validations */
 	switch (request) {
@@ -150,40 +285,174 @@ static void omap_rpmsg_get(struct virtio_device *vdev, unsigned int request,
 		memcpy(buf, &base, len);
 		break;
 	case VIRTIO_IPC_BUF_NUM:
-		num_bufs = RP_MSG_NUM_BUFS;
+		num_bufs = rx_bufs + tx_bufs;
 		memcpy(buf, &num_bufs, min(len, sizeof(num_bufs)));
 		break;
 	case VIRTIO_IPC_BUF_SZ:
-		buf_size = RP_MSG_BUF_SIZE;
+		/* legacy request; only meaningful if both sizes are equal */
+		buf_size = rx_buf_size;
 		memcpy(buf, &buf_size, min(len, sizeof(buf_size)));
 		break;
+	case VIRTIO_IPC_RX_BUF_NUM:
+		memcpy(buf, &rx_bufs, min(len, sizeof(rx_bufs)));
+		break;
+	case VIRTIO_IPC_TX_BUF_NUM:
+		memcpy(buf, &tx_bufs, min(len, sizeof(tx_bufs)));
+		break;
+	case VIRTIO_IPC_RX_BUF_SZ:
+		memcpy(buf, &rx_buf_size, min(len, sizeof(rx_buf_size)));
+		break;
+	case VIRTIO_IPC_TX_BUF_SZ:
+		memcpy(buf, &tx_buf_size, min(len, sizeof(tx_buf_size)));
+		break;
+	case VIRTIO_IPC_NUM_VQ_PAIRS:
+		memcpy(buf, &vq_pairs, min(len, sizeof(vq_pairs)));
+		break;
+	case VIRTIO_IPC_PRIO_VQ:
+		val = prio_lane;
+		memcpy(buf, &val, min(len, sizeof(val)));
+		break;
+	case VIRTIO_IPC_BUF_CACHE_OPS:
+		WARN_ON(len != sizeof(ops));
+		ops = rpdev->buf_cached ? &omap_rpmsg_cache_ops : NULL;
+		memcpy(buf, &ops, min(len, sizeof(ops)));
+		break;
 	default:
 		pr_err("invalid request: %d\n", request);
 	}
 }
 
 /* kick the remote processor, and let it know which virtqueue to poke at */
-static void omap_rpmsg_notify(struct virtqueue *vq)
+static void omap_rpmsg_kick(struct omap_rpmsg_vq_info *rpvq)
 {
-	struct omap_rpmsg_vq_info *rpvq = vq->priv;
 	int ret;
 
 	pr_debug("sending mailbox msg: %d\n", rpvq->vq_id);
+	trace_rpmsg_mbox_tx(rpvq->rpdev->rproc_name, rpvq->vq_id);
 	/* send the index of the triggered virtqueue as the mailbox payload */
 	ret = omap_mbox_msg_send(rpvq->rpdev->mbox, rpvq->vq_id);
 	if (ret)
 		pr_err("ugh, omap_mbox_msg_send() failed: %d\n", ret);
 }
 
+/* send a postponed kick, along with all the ones merged into it */
+static enum hrtimer_restart omap_rpmsg_kick_timer(struct hrtimer *timer)
+{
+	struct omap_rpmsg_vq_info *rpvq = container_of(timer,
+				struct omap_rpmsg_vq_info, kick_timer.timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&rpvq->kick_lock, flags);
+	rpvq->kick_pending = false;
+	rpvq->last_kick = ktime_get();
+	spin_unlock_irqrestore(&rpvq->kick_lock, flags);
+
+	omap_rpmsg_kick(rpvq);
+
+	return HRTIMER_NORESTART;
+}
+
+static void omap_rpmsg_notify(struct virtqueue *vq)
+{
+	struct omap_rpmsg_vq_info *rpvq = vq->priv;
+	unsigned int delay = kick_delay_us;
+	unsigned long flags;
+	ktime_t now, next;
+
+	if (!delay) {
+		omap_rpmsg_kick(rpvq);
+		return;
+	}
+
+	spin_lock_irqsave(&rpvq->kick_lock, flags);
+
+	/* a kick is already on its way: it will cover this one too */
+	if (rpvq->kick_pending) {
+		spin_unlock_irqrestore(&rpvq->kick_lock, flags);
+		return;
+	}
+
+	now = ktime_get();
+	next = ktime_add_us(rpvq->last_kick, delay);
+
+	if (ktime_to_ns(ktime_sub(next, now)) > 0) {
+		rpvq->kick_pending = true;
+		tasklet_hrtimer_start(&rpvq->kick_timer, next,
+							HRTIMER_MODE_ABS);
+		spin_unlock_irqrestore(&rpvq->kick_lock, flags);
+		return;
+	}
+
+	rpvq->last_kick = now;
+	spin_unlock_irqrestore(&rpvq->kick_lock, flags);
+
+	omap_rpmsg_kick(rpvq);
+}
+
+/* the index of our vq which @msg kicks, or -1 if it's not such a message */
+static int omap_rpmsg_vq_index(struct omap_rpmsg_device *rpdev,
+							mbox_msg_t msg)
+{
+	/*
+	 * a new inbound message is waiting in our own vring (index 0).
+	 * Let's pretend the message explicitly contained the vring
+	 * index number and handle it generically
+	 */
+	if (msg == RP_MBOX_PENDING_MSG)
+		msg = rpdev->base_vq_id;
+
+	/* ignore vq indices which are clearly not for us */
+	if (msg < rpdev->base_vq_id)
+		return -1;
+
+	msg -= rpdev->base_vq_id;
+
+	/*
+	 * Currently both PENDING_MSG and explicit-virtqueue-index
+	 * messaging are supported.
+	 * Whatever approach is taken, at this point 'msg' contains
+	 * the index of the vring which was just triggered.
+	 */
+	return msg < rpdev->num_of_vqs ? msg : -1;
+}
+
+/* fast path: called in the mailbox interrupt, so it must not sleep */
+static int omap_rpmsg_mbox_irq(struct notifier_block *this,
+					unsigned long index, void *data)
+{
+	mbox_msg_t msg = (mbox_msg_t) data;
+	struct omap_rpmsg_device *rpdev;
+	int vq;
+
+	rpdev = container_of(this, struct omap_rpmsg_device, irq_nb);
+
+	/* leave anything else to omap_rpmsg_mbox_callback() */
+	vq = omap_rpmsg_vq_index(rpdev, msg);
+	if (vq < 0)
+		return NOTIFY_DONE;
+
+	trace_rpmsg_mbox_rx(rpdev->rproc_name, msg);
+
+	vring_interrupt(vq, rpdev->vq[vq]);
+
+	/*
+	 * the legacy RP_MBOX_PENDING_MSG doesn't say whose vring it is about,
+	 * so every rpdev sharing the mailbox must get to see it
+	 */
+	return msg == RP_MBOX_PENDING_MSG ? NOTIFY_DONE : NOTIFY_STOP;
+}
+
 static int omap_rpmsg_mbox_callback(struct notifier_block *this,
 					unsigned long index, void *data)
 {
 	mbox_msg_t msg = (mbox_msg_t) data;
 	struct omap_rpmsg_device *rpdev;
+	int vq;
 
 	rpdev = container_of(this, struct omap_rpmsg_device, nb);
 
 	pr_debug("mbox msg: 0x%x\n", msg);
+	trace_rpmsg_mbox_rx(rpdev->rproc_name, msg);
 
 	switch (msg) {
 	case RP_MBOX_CRASH:
@@ -193,29 +462,13 @@ static int omap_rpmsg_mbox_callback(struct notifier_block *this,
 	case RP_MBOX_ECHO_REPLY:
 		pr_info("received echo reply from %s !\n", rpdev->rproc_name);
 		break;
-	case RP_MBOX_PENDING_MSG:
-		/*
-		 * a new inbound message is waiting in our own vring (index 0).
-		 * Let's pretend the message explicitly contained the vring
-		 * index number and handle it generically
-		 */
-		msg = rpdev->base_vq_id;
-		/* intentional fall-through */
 	default:
-		/* ignore vq indices which are clearly not for us */
-		if (msg < rpdev->base_vq_id)
+		/* kicks were already handled by the fast path, if enabled */
+		if (irq_rx)
 			break;
-
-		msg -= rpdev->base_vq_id;
-
-		/*
-		 * Currently both PENDING_MSG and explicit-virtqueue-index
-		 * messaging are supported.
-		 * Whatever approach is taken, at this point 'msg' contains
-		 * the index of the vring which was just triggered.
-		 */
-		if (msg < rpdev->num_of_vqs)
-			vring_interrupt(msg, rpdev->vq[msg]);
+		vq = omap_rpmsg_vq_index(rpdev, msg);
+		if (vq >= 0)
+			vring_interrupt(vq, rpdev->vq[vq]);
 	}
 
 	return NOTIFY_DONE;
@@ -229,6 +482,8 @@ static struct virtqueue *rp_find_vq(struct virtio_device *vdev,
 	struct omap_rpmsg_device *rpdev = to_omap_rpdev(vdev);
 	struct omap_rpmsg_vq_info *rpvq;
 	struct virtqueue *vq;
+	/* the first vring of each pair is our RX one, the second our TX one */
+	unsigned int num = (index & 1 ? tx_bufs : rx_bufs) / vq_pairs;
 	int err;
 
 	rpvq = kmalloc(sizeof(*rpvq), GFP_KERNEL);
@@ -238,18 +493,18 @@ static struct virtqueue *rp_find_vq(struct virtio_device *vdev,
 	/* map the vring using uncacheable memory (which is ioremap's default,
 	 * but let's make it explicit) and cast away sparse's complaints */
 	rpvq->addr = (__force void *) ioremap_nocache(rpdev->vring[index],
-							RP_MSG_RING_SIZE);
+							RP_MSG_RING_SIZE(num));
 	if (!rpvq->addr) {
 		err = -ENOMEM;
 		goto free_rpvq;
 	}
 
-	memset(rpvq->addr, 0, RP_MSG_RING_SIZE);
+	memset(rpvq->addr, 0, RP_MSG_RING_SIZE(num));
 
 	pr_debug("vring%d: phys 0x%x, virt 0x%x\n", index, rpdev->vring[index],
 					(unsigned int) rpvq->addr);
 
-	vq = vring_new_virtqueue(RP_MSG_NUM_BUFS/2, RP_MSG_VRING_ALIGN, vdev,
+	vq = vring_new_virtqueue(num, RP_MSG_VRING_ALIGN, vdev,
 				rpvq->addr, omap_rpmsg_notify, callback, name);
 	if (!vq) {
 		pr_err("vring_new_virtqueue failed\n");
@@ -263,6 +518,12 @@ static struct virtqueue *rp_find_vq(struct virtio_device *vdev,
 	rpvq->vq_id = rpdev->base_vq_id + index;
 	rpvq->rpdev = rpdev;
 
+	spin_lock_init(&rpvq->kick_lock);
+	tasklet_hrtimer_init(&rpvq->kick_timer, omap_rpmsg_kick_timer,
+					CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	rpvq->last_kick = ktime_set(0, 0);
+	rpvq->kick_pending = false;
+
 	return vq;
 
 unmap_vring:
@@ -277,14 +538,25 @@ static void omap_rpmsg_del_vqs(struct virtio_device *vdev)
 	struct virtqueue *vq, *n;
 	struct omap_rpmsg_device *rpdev = to_omap_rpdev(vdev);
 
+	/*
+	 * make sure the mailbox interrupt is done with our vqs. this is the
+	 * only place irq_nb is unregistered, error paths included
+	 */
+	if (rpdev->mbox && irq_rx)
+		omap_mbox_irq_unregister(rpdev->mbox, &rpdev->irq_nb);
+
 	list_for_each_entry_safe(vq, n, &vdev->vqs, list) {
 		struct omap_rpmsg_vq_info *rpvq = vq->priv;
+		/* a postponed kick is pointless now */
+		tasklet_hrtimer_cancel(&rpvq->kick_timer);
 		vring_del_virtqueue(vq);
 		kfree(rpvq);
 	}
 
-	if (rpdev->mbox)
+	if (rpdev->mbox) {
 		omap_mbox_put(rpdev->mbox, &rpdev->nb);
+		rpdev->mbox = NULL;
+	}
 
 	if (rpdev->rproc)
 		omap_rproc_put(rpdev->rproc);
@@ -298,8 +570,8 @@ static int omap_rpmsg_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 	struct omap_rpmsg_device *rpdev = to_omap_rpdev(vdev);
 	int i, err;
 
-	/* assume a single remote processor for now (and therefore 2 vqs) */
-	if (nvqs != 2)
+	/* a pair of vqs for each pair of vrings we laid out */
+	if (nvqs != 2 * vq_pairs)
 		return -EINVAL;
 
 	for (i = 0; i < nvqs; ++i) {
@@ -313,8 +585,13 @@ static int omap_rpmsg_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 	rpdev->num_of_vqs = nvqs;
 
 	/* can be used as normal memory, so we cast away sparse's complaints */
-	rpdev->buf_mapped = (__force void *) ioremap_nocache(rpdev->buf_addr,
-							rpdev->buf_size);
+	if (cached_bufs)
+		rpdev->buf_mapped = (__force void *)
+			ioremap_cached(rpdev->buf_addr, rpdev->buf_size);
+	else
+		rpdev->buf_mapped = (__force void *)
+			ioremap_nocache(rpdev->buf_addr, rpdev->buf_size);
+	rpdev->buf_cached = cached_bufs;
 	if (!rpdev->buf_mapped) {
 		pr_err("ioremap failed\n");
 		err = -ENOMEM;
@@ -326,10 +603,16 @@ static int omap_rpmsg_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 	rpdev->mbox = omap_mbox_get(rpdev->mbox_name, &rpdev->nb);
 	if (IS_ERR(rpdev->mbox)) {
 		pr_err("failed to get mailbox %s\n", rpdev->mbox_name);
+		rpdev->mbox = NULL;
 		err = -EINVAL;
 		goto unmap_buf;
 	}
 
+	if (irq_rx) {
+		rpdev->irq_nb.notifier_call = omap_rpmsg_mbox_irq;
+		omap_mbox_irq_register(rpdev->mbox, &rpdev->irq_nb);
+	}
+
 	pr_debug("buf: phys 0x%x, virt 0x%x\n", rpdev->buf_addr,
 					(unsigned int) rpdev->buf_mapped);
 
@@ -337,7 +620,7 @@ static int omap_rpmsg_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 	err = omap_mbox_msg_send(rpdev->mbox, RP_MBOX_READY);
 	if (err) {
 		pr_err("ugh, omap_mbox_msg_send() failed: %d\n", err);
-		goto put_mbox;
+		goto unmap_buf;
 	}
 
 	/* send it the physical address of the mapped buffer + vrings, */
@@ -345,7 +628,7 @@ static int omap_rpmsg_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 	err = omap_mbox_msg_send(rpdev->mbox, (mbox_msg_t) rpdev->buf_addr);
 	if (err) {
 		pr_err("ugh, omap_mbox_msg_send() failed: %d\n", err);
-		goto put_mbox;
+		goto unmap_buf;
 	}
 
 	/* ping the remote processor. this is only for fun (i.e. sanity);
@@ -353,7 +636,7 @@ static int omap_rpmsg_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 	err = omap_mbox_msg_send(rpdev->mbox, RP_MBOX_ECHO_REQUEST);
 	if (err) {
 		pr_err("ugh, omap_mbox_msg_send() failed: %d\n", err);
-		goto put_mbox;
+		goto unmap_buf;
 	}
 
 	/* load the firmware, and take the M3 out of reset */
@@ -365,11 +648,10 @@ static int omap_rpmsg_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 
 	return 0;
 
-put_mbox:
-	omap_mbox_put(rpdev->mbox, &rpdev->nb);
 unmap_buf:
 	iounmap((__force void __iomem *)rpdev->buf_mapped);
 error:
+	/* this also unregisters irq_nb and puts the mailbox, if we got it */
 	omap_rpmsg_del_vqs(vdev);
 	return err;
 }
@@ -393,11 +675,13 @@ static void omap_rpmsg_reset(struct virtio_device *vdev)
 
 static u32 omap_rpmsg_get_features(struct virtio_device *vdev)
 {
-	return 0;
+	return event_idx ? 1 << VIRTIO_RING_F_EVENT_IDX : 0;
 }
 
 static void omap_rpmsg_finalize_features(struct virtio_device *vdev)
 {
+	/* give vring a chance to accept features */
+	vring_transport_features(vdev);
 }
 
 static struct virtio_config_ops omap_rpmsg_config_ops = {
@@ -416,39 +700,85 @@ static struct omap_rpmsg_device omap_rpmsg_devices[] = {
 	{
 		.vdev.id.device	= VIRTIO_ID_RPMSG,
 		.vdev.config	= &omap_rpmsg_config_ops,
-		.buf_size	= RP_MSG_BUFS_SPACE,
 		.mbox_name	= "mailbox-1",
 		.rproc_name	= "ipu",
 		.buf_addr	= CORE0_BUFS_PHYS,
-		.vring[0]	= CORE0_VRING0_PHYS,
-		.vring[1]	= CORE0_VRING1_PHYS,
-		.id		= 0,
-		.base_vq_id	= 0,
+		.id		= 1,
 	},
 	/* rpmsg ipu_c1 backend */
 	{
 		.vdev.id.device	= VIRTIO_ID_RPMSG,
 		.vdev.config	= &omap_rpmsg_config_ops,
-		.buf_size	= RP_MSG_BUFS_SPACE,
 		.mbox_name	= "mailbox-1",
 		.rproc_name	= "ipu",
 		.buf_addr	= CORE1_BUFS_PHYS,
-		.vring[0]	= CORE1_VRING0_PHYS,
-		.vring[1]	= CORE1_VRING1_PHYS,
-		.id		= 1,
-		.base_vq_id	= 2,
+		.id		= 2,
 	},
 };
 
+static bool __init omap_rpmsg_valid_bufs(unsigned int num, unsigned int size)
+{
+	return num && is_power_of_2(num) && size >= RP_MSG_MIN_BUF_SIZE &&
+		size <= RP_MSG_MAX_BUF_SIZE && IS_ALIGNED(size, L1_CACHE_BYTES);
+}
+
+/*
+ * lay out the buffers and vrings of a remote processor in its region.
+ * returns the end of the region that is in use.
+ */
+static unsigned int __init omap_rpmsg_layout(struct omap_rpmsg_device *rpdev)
+{
+	unsigned int addr;
+	int i;
+
+	rpdev->buf_size = PAGE_ALIGN(rx_bufs * rx_buf_size +
+						tx_bufs * tx_buf_size);
+
+	addr = rpdev->buf_addr + rpdev->buf_size;
+	for (i = 0; i < vq_pairs; i++) {
+		rpdev->vring[2 * i] = addr;
+		addr += RP_MSG_RING_SIZE(rx_bufs / vq_pairs);
+		rpdev->vring[2 * i + 1] = addr;
+		addr += RP_MSG_RING_SIZE(tx_bufs / vq_pairs);
+	}
+
+	return addr;
+}
+
 static int __init omap_rpmsg_ini(void)
 {
 	int i, ret = 0;
 
+	if (!omap_rpmsg_valid_bufs(rx_bufs, rx_buf_size) ||
+				!omap_rpmsg_valid_bufs(tx_bufs, tx_buf_size)) {
+		pr_err("invalid buffers config: RX %u x %u, TX %u x %u\n",
+				rx_bufs, rx_buf_size, tx_bufs, tx_buf_size);
+		return -EINVAL;
+	}
+
+	if (!vq_pairs || !is_power_of_2(vq_pairs) ||
+			vq_pairs > RPMSG_MAX_VQ_PAIRS ||
+			vq_pairs > rx_bufs || vq_pairs > tx_bufs) {
+		pr_err("invalid number of vring pairs: %u\n", vq_pairs);
+		return -EINVAL;
+	}
+
 	for (i = 0; i < ARRAY_SIZE(omap_rpmsg_devices); i++) {
 		struct omap_rpmsg_device *rpdev = &omap_rpmsg_devices[i];
 
-		pr_debug("rpdev%d: buf 0x%x, vring0 0x%x, vring1 0x%x\n", i,
-			rpdev->buf_addr, rpdev->vring[0], rpdev->vring[1]);
+		/* vq ids (i.e. mailbox payloads) are unique across devices */
+		rpdev->base_vq_id = i * 2 * vq_pairs;
+
+		if (omap_rpmsg_layout(rpdev) >
+				rpdev->buf_addr + RP_MSG_REGION_SIZE) {
+			pr_err("buffers and vrings don't fit in 0x%x bytes\n",
+							RP_MSG_REGION_SIZE);
+			ret = -ENOSPC;
+			break;
+		}
+
+		pr_debug("rpdev%d: buf 0x%x, vring0 0x%x, %u vring pairs\n", i,
+			rpdev->buf_addr, rpdev->vring[0], vq_pairs);
 
 		ret = register_virtio_device(&rpdev->vdev);
 		if (ret) {
@@ -0,0 +1,429 @@
+/*
+ * Remote processor messaging benchmark driver
+ *
+ * Copyright (C) 2011 Texas Instruments, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#define pr_fmt(fmt) "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/rpmsg.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+
+/*
+ * Usage (per rpmsg-bench channel, i.e. per remote processor):
+ *
+ *   cd /sys/kernel/debug/rpmsg_bench/<channel>
+ *   echo 256 > payload_size
+ *   echo 4 > num_threads
+ *   echo 1 > roundtrip
+ *   echo 1 > run
+ *   cat results
+ *
+ * Every thread uses its own endpoint. In round-trip mode, each thread
+ * keeps a single message in flight, and waits for the remote's echo
+ * before sending the next one: latencies are round-trip times. In one-way
+ * mode, threads send back to back without waiting for anything, and
+ * latencies are the time it takes to send a message.
+ */
+
+/* how long a thread waits for an echo before giving up */
+#define RPMSG_BENCH_TIMEOUT	(HZ)
+
+static struct dentry *rpmsg_bench_root;
+
+/**
+ * struct rpmsg_bench - state of a benchmark channel
+ * @rpdev:	the rpmsg channel
+ * @dir:	debugfs directory of this channel
+ * @lock:	serializes runs, and protects the results
+ * @payload_size: size of the messages to send
+ * @num_msgs:	total number of messages to send, split among the threads
+ * @num_threads: number of concurrent sending threads (and endpoints)
+ * @roundtrip:	wait for each message to be echoed back before the next one
+ * @lat:	latency samples (in ns) of the last run
+ * @sent:	number of messages sent during the last run
+ * @elapsed_ns:	duration of the last run
+ * @err:	first error encountered during the last run, if any
+ */
+struct rpmsg_bench {
+	struct rpmsg_channel *rpdev;
+	struct dentry *dir;
+	struct mutex lock;
+	u32 payload_size;
+	u32 num_msgs;
+	u32 num_threads;
+	u32 roundtrip;
+	u32 *lat;
+	int sent;
+	u64 elapsed_ns;
+	int err;
+};
+
+/**
+ * struct rpmsg_bench_thread - a sending thread
+ * @bench:	the benchmark this thread belongs to
+ * @ept:	the endpoint this thread sends from
+ * @buf:	the message to send
+ * @reply:	completed when the echo of the pending message arrives
+ * @expected:	sequence number of the pending message
+ * @finished:	completed when the thread is done
+ * @lat:	where to store the latency samples of this thread
+ * @count:	number of messages to send
+ * @sent:	number of messages that were sent successfully
+ * @err:	what stopped the thread, if anything
+ */
+struct rpmsg_bench_thread {
+	struct rpmsg_bench *bench;
+	struct rpmsg_endpoint *ept;
+	u32 *buf;
+	struct completion reply;
+	u32 expected;
+	struct completion finished;
+	u32 *lat;
+	int count;
+	int sent;
+	int err;
+};
+
+static void rpmsg_bench_ept_cb(struct rpmsg_channel *rpdev, void *data,
+					int len, void *priv, u32 src)
+{
+	struct rpmsg_bench_thread *t = priv;
+
+	/* ignore echoes of messages we already gave up on */
+	if (len >= sizeof(u32) && *(u32 *) data == ACCESS_ONCE(t->expected))
+		complete(&t->reply);
+}
+
+static int rpmsg_bench_thread(void *data)
+{
+	struct rpmsg_bench_thread *t = data;
+	struct rpmsg_bench *bench = t->bench;
+	struct rpmsg_channel *rpdev = bench->rpdev;
+	ktime_t start;
+	int i, err = 0;
+
+	for (i = 0; i < t->count; i++) {
+		*t->buf = i;
+		t->expected = i;
+
+		start = ktime_get();
+
+		err = rpmsg_send_offchannel(rpdev, t->ept->addr, rpdev->dst,
+						t->buf, bench->payload_size);
+		if (err)
+			break;
+
+		if (bench->roundtrip && !wait_for_completion_timeout(&t->reply,
+							RPMSG_BENCH_TIMEOUT)) {
+			err = -ETIMEDOUT;
+			break;
+		}
+
+		t->lat[i] = ktime_to_ns(ktime_sub(ktime_get(), start));
+	}
+
+	t->sent = i;
+	t->err = err;
+	complete(&t->finished);
+
+	return 0;
+}
+
+static int rpmsg_bench_cmp(const void *a, const void *b)
+{
+	u32 x = *(u32 *) a, y = *(u32 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* run the benchmark. must be called with bench->lock held */
+static int rpmsg_bench_run(struct rpmsg_bench *bench)
+{
+	struct rpmsg_bench_thread *threads;
+	int i, n = bench->num_threads;
+	int per_thread = bench->num_msgs / n;
+	ktime_t start;
+	int err = 0;
+
+	if (!n || !per_thread || bench->payload_size < sizeof(u32) ||
+			bench->payload_size > RPMSG_MAX_MSG_SIZE)
+		return -EINVAL;
+
+	bench->sent = 0;
+	bench->err = 0;
+
+	vfree(bench->lat);
+	bench->lat = vmalloc(n * per_thread * sizeof(u32));
+	if (!bench->lat)
+		return -ENOMEM;
+
+	threads = kcalloc(n, sizeof(*threads), GFP_KERNEL);
+	if (!threads)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		struct rpmsg_bench_thread *t = &threads[i];
+
+		t->bench = bench;
+		t->count = per_thread;
+		t->lat = bench->lat + i * per_thread;
+		init_completion(&t->reply);
+		init_completion(&t->finished);
+
+		t->buf = kzalloc(bench->payload_size, GFP_KERNEL);
+		if (!t->buf) {
+			err = -ENOMEM;
+			goto cleanup;
+		}
+
+		t->ept = rpmsg_create_ept(bench->rpdev, rpmsg_bench_ept_cb, t,
+							RPMSG_ADDR_ANY);
+		if (!t->ept) {
+			err = -ENOMEM;
+			goto cleanup;
+		}
+	}
+
+	start = ktime_get();
+
+	for (i = 0; i < n; i++) {
+		struct task_struct *task;
+
+		task = kthread_run(rpmsg_bench_thread, &threads[i],
+							"rpmsg-bench/%d", i);
+		if (IS_ERR(task)) {
+			threads[i].err = PTR_ERR(task);
+			complete(&threads[i].finished);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		struct rpmsg_bench_thread *t = &threads[i];
+
+		wait_for_completion(&t->finished);
+
+		/* squeeze the valid samples together */
+		memmove(bench->lat + bench->sent, t->lat,
+						t->sent * sizeof(u32));
+		bench->sent += t->sent;
+		if (t->err && !bench->err)
+			bench->err = t->err;
+	}
+
+	bench->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	sort(bench->lat, bench->sent, sizeof(u32), rpmsg_bench_cmp, NULL);
+
+cleanup:
+	for (i = 0; i < n; i++) {
+		if (threads[i].ept)
+			rpmsg_destroy_ept(threads[i].ept);
+		kfree(threads[i].buf);
+	}
+	kfree(threads);
+	return err;
+}
+
+static int rpmsg_bench_results_show(struct seq_file *s, void *unused)
+{
+	struct rpmsg_bench *bench = s->private;
+	u64 elapsed_us, bytes, rate;
+	u32 frac;
+	int n;
+
+	mutex_lock(&bench->lock);
+
+	n = bench->sent;
+	if (!bench->lat || !n) {
+		seq_printf(s, "no results\n");
+		goto out;
+	}
+
+	elapsed_us = div64_u64(bench->elapsed_ns, NSEC_PER_USEC) ? : 1;
+	bytes = (u64) n * bench->payload_size;
+
+	seq_printf(s, "mode:       %s\n", bench->roundtrip ? "roundtrip" :
+								"oneway");
+	seq_printf(s, "payload:    %u bytes\n", bench->payload_size);
+	seq_printf(s, "threads:    %u\n", bench->num_threads);
+	seq_printf(s, "messages:   %d (error: %d)\n", n, bench->err);
+	seq_printf(s, "elapsed:    %llu us\n", elapsed_us);
+	/* in hundredths of MB/s, so that slow runs don't just show 0 */
+	rate = div64_u64(bytes * USEC_PER_SEC, elapsed_us) * 100 >> 20;
+	rate = div_u64_rem(rate, 100, &frac);
+	seq_printf(s, "throughput: %llu msgs/s, %llu.%02u MB/s\n",
+			div64_u64((u64) n * USEC_PER_SEC, elapsed_us),
+			rate, frac);
+	seq_printf(s, "latency:    p50 %u ns, p99 %u ns, max %u ns\n",
+			bench->lat[n / 2], bench->lat[n * 99 / 100],
+			bench->lat[n - 1]);
+
+out:
+	mutex_unlock(&bench->lock);
+	return 0;
+}
+
+static int rpmsg_bench_results_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, rpmsg_bench_results_show, inode->i_private);
+}
+
+static const struct file_operations rpmsg_bench_results_fops = {
+	.open		= rpmsg_bench_results_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.owner		= THIS_MODULE,
+};
+
+static int rpmsg_bench_run_open(struct inode *inode, struct file *filp)
+{
+	filp->private_data = inode->i_private;
+	return 0;
+}
+
+/* writing anything to "run" runs the benchmark, and returns when it's done */
+static ssize_t rpmsg_bench_run_write(struct file *filp,
+			const char __user *ubuf, size_t len, loff_t *offp)
+{
+	struct rpmsg_bench *bench = filp->private_data;
+	int ret;
+
+	if (mutex_lock_interruptible(&bench->lock))
+		return -ERESTARTSYS;
+
+	ret = rpmsg_bench_run(bench);
+
+	mutex_unlock(&bench->lock);
+
+	return ret ? ret : len;
+}
+
+static const struct file_operations rpmsg_bench_run_fops = {
+	.open		= rpmsg_bench_run_open,
+	.write		= rpmsg_bench_run_write,
+	.owner		= THIS_MODULE,
+};
+
+static int rpmsg_bench_probe(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_bench *bench;
+
+	bench = kzalloc(sizeof(*bench), GFP_KERNEL);
+	if (!bench) {
+		dev_err(&rpdev->dev, "kzalloc failed\n");
+		return -ENOMEM;
+	}
+
+	bench->rpdev = rpdev;
+	bench->payload_size = 64;
+	bench->num_msgs = 10000;
+	bench->num_threads = 1;
+	bench->roundtrip = 1;
+	mutex_init(&bench->lock);
+
+	bench->dir = debugfs_create_dir(dev_name(&rpdev->dev),
+							rpmsg_bench_root);
+	if (!bench->dir) {
+		dev_err(&rpdev->dev, "failed to create debugfs dir\n");
+		kfree(bench);
+		return -ENOMEM;
+	}
+
+	debugfs_create_u32("payload_size", S_IRUGO | S_IWUSR, bench->dir,
+							&bench->payload_size);
+	debugfs_create_u32("num_msgs", S_IRUGO | S_IWUSR, bench->dir,
+							&bench->num_msgs);
+	debugfs_create_u32("num_threads", S_IRUGO | S_IWUSR, bench->dir,
+							&bench->num_threads);
+	debugfs_create_bool("roundtrip", S_IRUGO | S_IWUSR, bench->dir,
+							&bench->roundtrip);
+	debugfs_create_file("run", S_IWUSR, bench->dir, bench,
+							&rpmsg_bench_run_fops);
+	debugfs_create_file("results", S_IRUGO, bench->dir, bench,
+						&rpmsg_bench_results_fops);
+
+	dev_set_drvdata(&rpdev->dev, bench);
+
+	dev_info(&rpdev->dev, "new bench channel: 0x%x -> 0x%x!\n",
+						rpdev->src, rpdev->dst);
+	return 0;
+}
+
+static void __devexit rpmsg_bench_remove(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_bench *bench = dev_get_drvdata(&rpdev->dev);
+
+	debugfs_remove_recursive(bench->dir);
+
+	/* wait for a run that might still be in progress */
+	mutex_lock(&bench->lock);
+	mutex_unlock(&bench->lock);
+
+	vfree(bench->lat);
+	kfree(bench);
+}
+
+static void rpmsg_bench_driver_cb(struct rpmsg_channel *rpdev, void *data,
+						int len, void *priv, u32 src)
+{
+	dev_warn(&rpdev->dev, "uhm, unexpected message\n");
+}
+
+static struct rpmsg_device_id rpmsg_bench_id_table[] = {
+	{ .name	= "rpmsg-bench" },
+	{ },
+};
+MODULE_DEVICE_TABLE(platform, rpmsg_bench_id_table);
+
+static struct rpmsg_driver rpmsg_bench_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= rpmsg_bench_id_table,
+	.probe		= rpmsg_bench_probe,
+	.callback	= rpmsg_bench_driver_cb,
+	.remove		= __devexit_p(rpmsg_bench_remove),
+};
+
+static int __init init(void)
+{
+	int ret;
+
+	rpmsg_bench_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (!rpmsg_bench_root)
+		return -ENOMEM;
+
+	ret = register_rpmsg_driver(&rpmsg_bench_driver);
+	if (ret)
+		debugfs_remove(rpmsg_bench_root);
+
+	return ret;
+}
+module_init(init);
+
+static void __exit fini(void)
+{
+	unregister_rpmsg_driver(&rpmsg_bench_driver);
+	debugfs_remove(rpmsg_bench_root);
+}
+module_exit(fini);
+
+MODULE_DESCRIPTION("Remote processor messaging benchmark driver");
+MODULE_LICENSE("GPL v2");
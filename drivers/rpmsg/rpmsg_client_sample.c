@@ -41,8 +41,8 @@ static void rpmsg_sample_cb(struct rpmsg_channel *rpdev, void *data, int len,
 		return;
 	}
 
-	/* send a new message now */
-	err = rpmsg_send(rpdev, MSG, strlen(MSG));
+	/* send a new message now (we're in the callback, so don't sleep) */
+	err = rpmsg_trysend(rpdev, MSG, strlen(MSG));
 	if (err)
 		pr_err("rpmsg_send failed: %d\n", err);
 }
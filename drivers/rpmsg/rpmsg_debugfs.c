@@ -0,0 +1,174 @@
+/*
+ * Remote processor messaging debugfs statistics
+ *
+ * Copyright (C) 2011 Texas Instruments, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#define pr_fmt(fmt) "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/err.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/math64.h>
+
+#include "rpmsg_internal.h"
+
+/*
+ * For each remote processor, /sys/kernel/debug/rpmsg/rproc<id>/ has:
+ *
+ * stats:	the remote processor's counters (summed over all cpus),
+ *		along with a few high-water marks (some per vq pair)
+ * endpoints:	for every endpoint address, the number of messages and
+ *		bytes it received, and how long its callback takes
+ */
+
+static struct dentry *rpmsg_dbg_root;
+
+static int rpmsg_stats_show(struct seq_file *s, void *unused)
+{
+	struct rpmsg_rproc *rp = s->private;
+	struct rpmsg_stats sum = { 0 };
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct rpmsg_stats *st = per_cpu_ptr(rp->stats, cpu);
+
+		sum.tx_msgs += st->tx_msgs;
+		sum.tx_bytes += st->tx_bytes;
+		sum.rx_msgs += st->rx_msgs;
+		sum.rx_bytes += st->rx_bytes;
+		sum.tx_no_buf += st->tx_no_buf;
+		sum.rx_dropped += st->rx_dropped;
+		sum.tx_kicks += st->tx_kicks;
+		sum.rx_kicks += st->rx_kicks;
+		sum.tx_irqs += st->tx_irqs;
+		sum.rx_irqs += st->rx_irqs;
+	}
+
+	seq_printf(s, "tx_msgs:         %llu\n", sum.tx_msgs);
+	seq_printf(s, "tx_bytes:        %llu\n", sum.tx_bytes);
+	seq_printf(s, "rx_msgs:         %llu\n", sum.rx_msgs);
+	seq_printf(s, "rx_bytes:        %llu\n", sum.rx_bytes);
+	seq_printf(s, "tx_no_buf:       %llu\n", sum.tx_no_buf);
+	seq_printf(s, "rx_dropped:      %llu\n", sum.rx_dropped);
+	seq_printf(s, "tx_kicks:        %llu\n", sum.tx_kicks);
+	seq_printf(s, "rx_kicks:        %llu\n", sum.rx_kicks);
+	seq_printf(s, "tx_irqs:         %llu\n", sum.tx_irqs);
+	seq_printf(s, "rx_irqs:         %llu\n", sum.rx_irqs);
+	seq_printf(s, "rx_batch_hwm:    %d/%d\n", rp->rx_batch_hwm,
+							rp->num_rx_bufs);
+	seq_printf(s, "rx_held:         %d/%d\n", atomic_read(&rp->rx_held),
+							rp->num_rx_bufs);
+
+	for (i = 0; i < rp->num_vq_pairs; i++)
+		seq_printf(s, "vq%d tx_inflight_hwm: %d/%d\n", i,
+				rp->vqp[i].tx_inflight_hwm, rp->vq_tx_bufs);
+
+	return 0;
+}
+
+static int rpmsg_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, rpmsg_stats_show, inode->i_private);
+}
+
+static const struct file_operations rpmsg_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rpmsg_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int rpmsg_ept_show(int id, void *p, void *data)
+{
+	struct rpmsg_endpoint *ept = p;
+	struct seq_file *s = data;
+	u64 avg = ept->rx_msgs ? div64_u64(ept->cb_ns_total, ept->rx_msgs) : 0;
+
+	seq_printf(s, "0x%-8x %-12llu %-12llu %-12llu %-12llu %-10llu "
+			"%-12llu %llu\n", ept->addr,
+			ept->rx_msgs, ept->rx_bytes,
+			(unsigned long long) atomic64_read(&ept->tx_msgs),
+			(unsigned long long) atomic64_read(&ept->tx_bytes),
+			(unsigned long long) atomic64_read(&ept->tx_no_buf),
+			avg, ept->cb_ns_max);
+
+	return 0;
+}
+
+static int rpmsg_endpoints_show(struct seq_file *s, void *unused)
+{
+	struct rpmsg_rproc *rp = s->private;
+
+	seq_printf(s, "%-10s %-12s %-12s %-12s %-12s %-10s %-12s %s\n",
+				"addr", "rx_msgs", "rx_bytes", "tx_msgs",
+				"tx_bytes", "tx_no_buf", "cb_avg_ns",
+				"cb_max_ns");
+
+	spin_lock(&rp->endpoints_lock);
+	idr_for_each(&rp->endpoints, rpmsg_ept_show, s);
+	spin_unlock(&rp->endpoints_lock);
+
+	return 0;
+}
+
+static int rpmsg_endpoints_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, rpmsg_endpoints_show, inode->i_private);
+}
+
+static const struct file_operations rpmsg_endpoints_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rpmsg_endpoints_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+void rpmsg_debugfs_add(struct rpmsg_rproc *rp)
+{
+	char name[16];
+
+	if (!rpmsg_dbg_root)
+		return;
+
+	snprintf(name, sizeof(name), "rproc%d", rp->id);
+
+	rp->dbg_dir = debugfs_create_dir(name, rpmsg_dbg_root);
+	if (!rp->dbg_dir) {
+		dev_warn(&rp->vdev->dev, "failed to create debugfs dir\n");
+		return;
+	}
+
+	debugfs_create_file("stats", S_IRUGO, rp->dbg_dir, rp,
+							&rpmsg_stats_fops);
+	debugfs_create_file("endpoints", S_IRUGO, rp->dbg_dir, rp,
+							&rpmsg_endpoints_fops);
+}
+
+void rpmsg_debugfs_remove(struct rpmsg_rproc *rp)
+{
+	debugfs_remove_recursive(rp->dbg_dir);
+}
+
+void __init rpmsg_debugfs_init(void)
+{
+	rpmsg_dbg_root = debugfs_create_dir("rpmsg", NULL);
+	if (IS_ERR_OR_NULL(rpmsg_dbg_root)) {
+		pr_warn("failed to create debugfs dir\n");
+		rpmsg_dbg_root = NULL;
+	}
+}
+
+void __exit rpmsg_debugfs_fini(void)
+{
+	debugfs_remove(rpmsg_dbg_root);
+}
@@ -19,41 +19,179 @@
 #include <linux/module.h>
 #include <linux/virtio.h>
 #include <linux/idr.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
 #include <linux/rpmsg.h>
 
+struct rpmsg_hdr {
+	u16 len;
+	u16 flags;
+	u32 src;
+	u32 dst;
+	u32 unused;
+	u8 data[0];
+} __packed;
+
+/*
+ * The loopback transport echoes messages sent to this address back to
+ * their sender, much like the sample service of the remote processors.
+ */
+#define RPMSG_LOOPBACK_ECHO_ADDR	(50)
+
+/* Reserve address 60 for the OMX connection service */
+#define RPMSG_OMX_ADDR		(60)
+
 /**
- * struct rpmsg_rproc - rp_msg module state
- * @vdev:	the virtio device
+ * struct rpmsg_stats - per-cpu counters of a remote processor
+ * @tx_msgs:	messages (or fragments) handed over to the remote processor
+ * @tx_bytes:	payload bytes handed over to the remote processor
+ * @rx_msgs:	messages (or fragments) received from the remote processor
+ * @rx_bytes:	payload bytes received from the remote processor
+ * @tx_no_buf:	times a sender found all the TX buffers in use
+ * @rx_dropped:	inbound messages that were dropped, e.g. for lack of a
+ *		recipient
+ * @tx_kicks:	times the remote processor was told about new messages
+ * @rx_kicks:	times the remote processor was told about recycled RX buffers
+ * @tx_irqs:	"tx-complete" interrupts
+ * @rx_irqs:	RX interrupts
+ */
+struct rpmsg_stats {
+	u64 tx_msgs;
+	u64 tx_bytes;
+	u64 rx_msgs;
+	u64 rx_bytes;
+	u64 tx_no_buf;
+	u64 rx_dropped;
+	u64 tx_kicks;
+	u64 rx_kicks;
+	u64 tx_irqs;
+	u64 rx_irqs;
+};
+
+#define rpmsg_stat_inc(rp, field)	this_cpu_inc((rp)->stats->field)
+#define rpmsg_stat_add(rp, field, val)	this_cpu_add((rp)->stats->field, val)
+
+struct rpmsg_rproc;
+
+/**
+ * struct rpmsg_vq_pair - a pair of RX and TX virtqueues
+ * @rp:		the remote processor this pair belongs to
  * @rvq:	RX virtqueue (from pov of local processor)
  * @svq:	TX virtqueue (from pov of local processor)
- * @rbufs:	address of RX buffers
- * @sbufs:	address of TX buffers
+ * @tx_pool:	stack of free TX buffers
+ * @tx_free:	number of buffers currently sitting in @tx_pool
+ * @svq_lock:	protects the TX virtqueue and @tx_pool, to allow several
+ *		concurrent senders
+ * @rvq_lock:	protects the RX virtqueue, which is refilled both by the RX path
+ *		and by users releasing RX buffers they held on to. these
+ *		may do so from any context, so the lock is taken irqsave
+ * @sendq:	wait queue of senders waiting for a TX buffer
+ * @sleepers:	number of senders that are waiting for a TX buffer. "tx-complete"
+ *		interrupts are only enabled while this is non-zero
+ * @frag_lock:	serializes the sending of fragmented messages
+ * @tx_inflight_hwm: max number of TX buffers that were in use at once
+ * @tx_unkicked: messages were queued on the TX virtqueue, but the remote
+ *		processor wasn't kicked about them yet (see rpmsg_kick())
+ * @tx_poll_armed: a poller found too few free TX buffers, so "tx-complete"
+ *		interrupts stay enabled until a poller finds enough of them
+ *
+ * Each pair has its own locks and TX buffers, so senders that use
+ * different pairs never contend with each other.
+ */
+struct rpmsg_vq_pair {
+	struct rpmsg_rproc *rp;
+	struct virtqueue *rvq, *svq;
+	void **tx_pool;
+	int tx_free;
+	spinlock_t svq_lock;
+	spinlock_t rvq_lock;
+	wait_queue_head_t sendq;
+	int sleepers;
+	struct mutex frag_lock;
+	int tx_inflight_hwm;
+	bool tx_unkicked;
+	bool tx_poll_armed;
+};
+
+/**
+ * struct rpmsg_rproc - rp_msg module state
+ * @vdev:	the virtio device
+ * @vqp:	the RX/TX virtqueue pairs
+ * @num_vq_pairs: number of entries in @vqp that are in use
+ * @rbufs:	address of RX buffers (of all pairs)
+ * @sbufs:	address of TX buffers (of all pairs)
  * ... keep documenting ...
- * @svq_lock:	protects the TX virtqueue, to allow several concurrent senders
+ * @rx_refs:	per RX buffer reference count. the RX path owns a reference
+ *		while the endpoint callback runs, and rpmsg_hold_rx_buffer()
+ *		takes another one. the buffer goes back to the remote processor
+ *		once the last reference is dropped
+ * @rx_held:	number of RX buffers users currently hold
+ * @rx_thread:	the thread that dispatches inbound messages of all the pairs
+ * @rx_next_vqp: the pair the RX thread starts its next pass with
+ * @rx_owner:	bit 0 is set while a context (normally the RX thread, or
+ *		else a busy-polling reader) is draining the RX rings
+ * @prio_lane:	non-zero if the first pair is dedicated to high priority
+ *		messages
+ * @tx_reserve:	number of TX buffers of each pair that only high priority
+ *		messages may use
+ * @cache_ops:	cache maintenance ops if the buffers are mapped cacheable,
+ *		NULL otherwise
+ * @stats:	per-cpu counters
+ * @rx_batch_hwm: max number of messages the RX thread handled in one pass
+ * @dbg_dir:	debugfs directory of this remote processor
  * @id:		remote processor id
+ * @num_rx_bufs: number of RX buffers, split evenly between the pairs
+ * @num_tx_bufs: number of TX buffers, split evenly between the pairs
+ * @vq_rx_bufs: number of RX buffers of each pair
+ * @vq_tx_bufs: number of TX buffers of each pair
+ * @rx_buf_size: size of each RX buffer, including the rpmsg header
+ * @tx_buf_size: size of each TX buffer, including the rpmsg header
  *
  * This structure stores the rp_msg state of a given virtio device (i.e.
  * one specific remote processor).
  */
 struct rpmsg_rproc {
 	struct virtio_device *vdev;
-	struct virtqueue *rvq, *svq;
+	struct rpmsg_vq_pair vqp[RPMSG_MAX_VQ_PAIRS];
+	int num_vq_pairs;
 	void *rbufs, *sbufs;
-	int last_rbuf, last_sbuf;
 	void *sim_base;
-	spinlock_t svq_lock;
+	atomic_t *rx_refs;
+	atomic_t rx_held;
+	struct task_struct *rx_thread;
+	int rx_next_vqp;
+	unsigned long rx_owner;
+	int prio_lane;
+	int tx_reserve;
+	struct rpmsg_cache_ops *cache_ops;
+	struct rpmsg_stats __percpu *stats;
+	int rx_batch_hwm;
+	struct dentry *dbg_dir;
 	int id;
-	int num_bufs;
-	int buf_size;
+	int num_rx_bufs;
+	int num_tx_bufs;
+	int vq_rx_bufs;
+	int vq_tx_bufs;
+	int rx_buf_size;
+	int tx_buf_size;
 	struct idr endpoints;
 	spinlock_t endpoints_lock;
 	struct rpmsg_channel *rpcli;
 	struct rpmsg_channel *rpser;
 	struct rpmsg_channel *rpomx;
+	struct rpmsg_channel *rpbench;
 };
 
 struct rpmsg_channel *rpmsg_create_channel(struct rpmsg_rproc *rp,
 				char *name, u32 src, u32 dst);
 void rpmsg_destroy_channel(struct rpmsg_channel *rpdev);
 
+void rpmsg_debugfs_add(struct rpmsg_rproc *rp);
+void rpmsg_debugfs_remove(struct rpmsg_rproc *rp);
+void __init rpmsg_debugfs_init(void);
+void __exit rpmsg_debugfs_fini(void);
+
 #endif /* _DRIVERS_RPMSG_INTERNAL_H */
@@ -0,0 +1,529 @@
+/*
+ * Loopback remote processor messaging transport
+ *
+ * Copyright (C) 2011 Texas Instruments, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#define pr_fmt(fmt) "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_ring.h>
+#include <linux/workqueue.h>
+#include <linux/rpmsg.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/log2.h>
+#include <linux/io.h>
+
+#include "rpmsg_internal.h"
+
+/*
+ * This is a software-only rpmsg virtio device, with processor id 0. It
+ * plays the role of the remote processor itself: every message that is
+ * sent is moved over to the receive side, so local endpoints can talk to
+ * each other, and messages sent to RPMSG_LOOPBACK_ECHO_ADDR are bounced
+ * back to their sender. A minimal OMX connection service answers at
+ * RPMSG_OMX_ADDR, too.
+ *
+ * This allows running the rpmsg bus and its drivers on any machine,
+ * e.g. in order to benchmark or test them.
+ */
+
+static unsigned int num_bufs = 256;
+module_param(num_bufs, uint, S_IRUGO);
+MODULE_PARM_DESC(num_bufs, "Number of buffers in each direction (power of 2)");
+
+static unsigned int buf_size = 512;
+module_param(buf_size, uint, S_IRUGO);
+MODULE_PARM_DESC(buf_size, "Size of each buffer, header included");
+
+static unsigned int vq_pairs = 1;
+module_param(vq_pairs, uint, S_IRUGO);
+MODULE_PARM_DESC(vq_pairs, "Number of RX/TX vring pairs (power of 2)");
+
+static bool prio_lane;
+module_param(prio_lane, bool, S_IRUGO);
+MODULE_PARM_DESC(prio_lane, "Dedicate the first vring pair to urgent messages");
+
+static bool event_idx = true;
+module_param(event_idx, bool, S_IRUGO);
+MODULE_PARM_DESC(event_idx, "Offer event index notification suppression");
+
+#define RPMSG_LB_VRING_ALIGN	(PAGE_SIZE)
+
+/* virtqueue indices of a pair, from the pov of the rpmsg driver */
+#define RPMSG_LB_RVQ(pair)	(2 * (pair))
+#define RPMSG_LB_SVQ(pair)	(2 * (pair) + 1)
+
+/**
+ * struct rpmsg_lb_vring - the device side of a vring
+ * @vring:	the vring, as seen by the device
+ * @vq:		the rpmsg driver's virtqueue on top of @vring
+ * @pages:	memory backing @vring
+ * @size:	size of @pages
+ * @last_avail_idx: next available entry the device will consume
+ * @event:	VIRTIO_RING_F_EVENT_IDX was negotiated
+ */
+struct rpmsg_lb_vring {
+	struct vring vring;
+	struct virtqueue *vq;
+	void *pages;
+	size_t size;
+	u16 last_avail_idx;
+	bool event;
+};
+
+/**
+ * struct rpmsg_lb_device - the loopback rpmsg virtio device
+ * @vdev:	the virtio device
+ * @vr:		the device side of the RX and TX vrings of each pair
+ * @bufs:	the message buffers, RX ones first
+ * @bufs_size:	size of @bufs
+ * @wq:		runs the device side of the vrings
+ * @work:	moves messages from the TX vrings over to the RX vrings
+ */
+struct rpmsg_lb_device {
+	struct virtio_device vdev;
+	struct rpmsg_lb_vring vr[2 * RPMSG_MAX_VQ_PAIRS];
+	void *bufs;
+	size_t bufs_size;
+	struct workqueue_struct *wq;
+	struct work_struct work;
+};
+
+#define to_rpmsg_lb(vd) container_of(vd, struct rpmsg_lb_device, vdev)
+
+/* the bits of the OMX protocol (see rpmsg_omx.c) our OMX service speaks */
+#define RPMSG_LB_OMX_CONN_REQ	0
+#define RPMSG_LB_OMX_CONN_RSP	1
+#define RPMSG_LB_OMX_RAW_MSG	5
+#define RPMSG_LB_OMX_SUCCESS	0
+
+struct rpmsg_lb_omx_hdr {
+	u32 type;
+	u32 flags;
+	u32 len;
+	u8 data[0];
+} __packed;
+
+struct rpmsg_lb_omx_conn_rsp {
+	u32 status;
+	u32 addr;
+} __packed;
+
+/* provide the rpmsg driver with the device's details */
+static void rpmsg_lb_get(struct virtio_device *vdev, unsigned int request,
+			 void *buf, unsigned len)
+{
+	struct rpmsg_lb_device *lb = to_rpmsg_lb(vdev);
+	void *ptr = NULL;
+	int val;
+
+	switch (request) {
+	case VIRTIO_IPC_PROC_ID:
+		val = 0;
+		break;
+	case VIRTIO_IPC_BUF_ADDR:
+	case VIRTIO_IPC_SIM_BASE:
+		/* plain kernel memory, so no need to simulate anything */
+		ptr = lb->bufs;
+		/* intentional fall-through */
+	case VIRTIO_IPC_BUF_CACHE_OPS:
+		/* our "remote processor" shares our caches */
+		WARN_ON(len != sizeof(ptr));
+		memcpy(buf, &ptr, min(len, sizeof(ptr)));
+		return;
+	case VIRTIO_IPC_BUF_NUM:
+		val = 2 * num_bufs;
+		break;
+	case VIRTIO_IPC_RX_BUF_NUM:
+	case VIRTIO_IPC_TX_BUF_NUM:
+		val = num_bufs;
+		break;
+	case VIRTIO_IPC_BUF_SZ:
+	case VIRTIO_IPC_RX_BUF_SZ:
+	case VIRTIO_IPC_TX_BUF_SZ:
+		val = buf_size;
+		break;
+	case VIRTIO_IPC_NUM_VQ_PAIRS:
+		val = vq_pairs;
+		break;
+	case VIRTIO_IPC_PRIO_VQ:
+		val = prio_lane;
+		break;
+	default:
+		pr_err("invalid request: %d\n", request);
+		return;
+	}
+
+	memcpy(buf, &val, min(len, sizeof(val)));
+}
+
+/*
+ * is there a buffer the driver made available to us ?
+ *
+ * With event indices, this also tells the driver that the next entry it
+ * makes available is the one to kick us about. The barrier orders that
+ * against reading the avail index, so either we see the new entry here,
+ * or the driver sees our event index and kicks us.
+ */
+static bool rpmsg_lb_has_avail(struct rpmsg_lb_vring *lbvr)
+{
+	if (lbvr->event) {
+		vring_avail_event(&lbvr->vring) = lbvr->last_avail_idx;
+		smp_mb();
+	}
+
+	return lbvr->last_avail_idx != lbvr->vring.avail->idx;
+}
+
+/* consume the next available buffer. rpmsg never chains descriptors */
+static void *rpmsg_lb_get_avail(struct rpmsg_lb_vring *lbvr, u16 *head,
+								u32 *len)
+{
+	struct vring *vr = &lbvr->vring;
+	struct vring_desc *desc;
+
+	if (!rpmsg_lb_has_avail(lbvr))
+		return NULL;
+
+	/* read the entry only after having seen the index that published it */
+	smp_rmb();
+
+	*head = vr->avail->ring[lbvr->last_avail_idx++ % vr->num];
+	desc = &vr->desc[*head];
+	*len = desc->len;
+
+	return phys_to_virt(desc->addr);
+}
+
+/* give a buffer back to the driver */
+static void rpmsg_lb_add_used(struct rpmsg_lb_vring *lbvr, u16 head, u32 len)
+{
+	struct vring *vr = &lbvr->vring;
+	struct vring_used_elem *used;
+
+	used = &vr->used->ring[vr->used->idx % vr->num];
+	used->id = head;
+	used->len = len;
+
+	/* the entry must be visible before the index that publishes it */
+	smp_wmb();
+	vr->used->idx++;
+}
+
+/*
+ * "interrupt" the driver, unless it asked us not to. @old is the used index
+ * the driver last heard about from us
+ */
+static void rpmsg_lb_interrupt(struct rpmsg_lb_vring *lbvr, u16 old)
+{
+	struct vring *vr = &lbvr->vring;
+	bool notify;
+
+	/* publish the used index before checking whether anyone cares */
+	smp_mb();
+
+	if (lbvr->event)
+		notify = vring_need_event(vring_used_event(vr), vr->used->idx,
+									old);
+	else
+		notify = !(vr->avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+
+	if (notify)
+		vring_interrupt(0, lbvr->vq);
+}
+
+/*
+ * The OMX connection service: connection requests are accepted, with the
+ * service's own address standing in for the new remote OMX instance, and
+ * raw messages are echoed back. Anything else (e.g. a disconnection) needs
+ * no response, so false is returned and @msg is dropped.
+ *
+ * Fragmented messages are too big to be anything but raw messages, and are
+ * echoed back as they are.
+ */
+static bool rpmsg_lb_omx(struct rpmsg_hdr *msg)
+{
+	struct rpmsg_lb_omx_hdr *hdr = (struct rpmsg_lb_omx_hdr *) msg->data;
+	struct rpmsg_lb_omx_conn_rsp *rsp;
+
+	if (msg->flags)
+		goto echo;
+
+	if (msg->len < sizeof(*hdr))
+		return false;
+
+	switch (hdr->type) {
+	case RPMSG_LB_OMX_CONN_REQ:
+		/* the request is bigger than the response, so it fits */
+		if (msg->len < sizeof(*hdr) + sizeof(*rsp))
+			return false;
+		rsp = (struct rpmsg_lb_omx_conn_rsp *) hdr->data;
+		rsp->status = RPMSG_LB_OMX_SUCCESS;
+		rsp->addr = RPMSG_OMX_ADDR;
+		hdr->type = RPMSG_LB_OMX_CONN_RSP;
+		hdr->flags = 0;
+		hdr->len = sizeof(*rsp);
+		msg->len = sizeof(*hdr) + sizeof(*rsp);
+		break;
+	case RPMSG_LB_OMX_RAW_MSG:
+		break;
+	default:
+		return false;
+	}
+
+echo:
+	swap(msg->src, msg->dst);
+	return true;
+}
+
+/*
+ * Move every pending TX message of a pair over to a free RX buffer of the
+ * same pair. If we run out of RX buffers, the remaining messages wait
+ * until the driver recycles some, which it will kick us about.
+ */
+static void rpmsg_lb_forward(struct rpmsg_lb_vring *rx,
+						struct rpmsg_lb_vring *tx)
+{
+	struct rpmsg_hdr *msg, *rxmsg;
+	u16 head, rxhead;
+	u16 old_rx = rx->vring.used->idx, old_tx = tx->vring.used->idx;
+	u32 len, rxlen;
+	int forwarded = 0;
+
+	while (rpmsg_lb_has_avail(rx)) {
+		msg = rpmsg_lb_get_avail(tx, &head, &len);
+		if (!msg)
+			break;
+
+		/* the TX buffer is ours until it's used, so respond in place */
+		if (msg->dst == RPMSG_OMX_ADDR && !rpmsg_lb_omx(msg)) {
+			rpmsg_lb_add_used(tx, head, 0);
+			forwarded++;
+			continue;
+		}
+
+		rxmsg = rpmsg_lb_get_avail(rx, &rxhead, &rxlen);
+
+		len = min(len, rxlen);
+		memcpy(rxmsg, msg, len);
+
+		if (rxmsg->dst == RPMSG_LOOPBACK_ECHO_ADDR)
+			swap(rxmsg->src, rxmsg->dst);
+
+		rpmsg_lb_add_used(rx, rxhead, len);
+		rpmsg_lb_add_used(tx, head, 0);
+		forwarded++;
+	}
+
+	if (forwarded) {
+		rpmsg_lb_interrupt(tx, old_tx);
+		rpmsg_lb_interrupt(rx, old_rx);
+	}
+}
+
+/* the pairs are serviced in order, so the priority lane always goes first */
+static void rpmsg_lb_work(struct work_struct *work)
+{
+	struct rpmsg_lb_device *lb = container_of(work, struct rpmsg_lb_device,
+									work);
+	int i;
+
+	for (i = 0; i < vq_pairs; i++)
+		rpmsg_lb_forward(&lb->vr[RPMSG_LB_RVQ(i)],
+						&lb->vr[RPMSG_LB_SVQ(i)]);
+}
+
+/* the driver kicked us: it has either sent messages, or freed RX buffers */
+static void rpmsg_lb_notify(struct virtqueue *vq)
+{
+	struct rpmsg_lb_device *lb = vq->priv;
+
+	queue_work(lb->wq, &lb->work);
+}
+
+static void rpmsg_lb_del_vqs(struct virtio_device *vdev)
+{
+	struct rpmsg_lb_device *lb = to_rpmsg_lb(vdev);
+	int i;
+
+	cancel_work_sync(&lb->work);
+
+	for (i = 0; i < ARRAY_SIZE(lb->vr); i++) {
+		struct rpmsg_lb_vring *lbvr = &lb->vr[i];
+
+		if (lbvr->vq)
+			vring_del_virtqueue(lbvr->vq);
+		if (lbvr->pages)
+			free_pages_exact(lbvr->pages, lbvr->size);
+
+		lbvr->vq = NULL;
+		lbvr->pages = NULL;
+	}
+}
+
+static int rpmsg_lb_find_vqs(struct virtio_device *vdev, unsigned nvqs,
+			     struct virtqueue *vqs[],
+			     vq_callback_t *callbacks[],
+			     const char *names[])
+{
+	struct rpmsg_lb_device *lb = to_rpmsg_lb(vdev);
+	unsigned int num = num_bufs / vq_pairs;
+	int i, err;
+
+	if (nvqs != 2 * vq_pairs)
+		return -EINVAL;
+
+	for (i = 0; i < nvqs; i++) {
+		struct rpmsg_lb_vring *lbvr = &lb->vr[i];
+
+		lbvr->size = vring_size(num, RPMSG_LB_VRING_ALIGN);
+		lbvr->pages = alloc_pages_exact(lbvr->size,
+						GFP_KERNEL | __GFP_ZERO);
+		if (!lbvr->pages) {
+			err = -ENOMEM;
+			goto error;
+		}
+
+		vring_init(&lbvr->vring, num, lbvr->pages, RPMSG_LB_VRING_ALIGN);
+		lbvr->last_avail_idx = 0;
+		lbvr->event = virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
+
+		vqs[i] = vring_new_virtqueue(num, RPMSG_LB_VRING_ALIGN,
+					vdev, lbvr->pages, rpmsg_lb_notify,
+					callbacks[i], names[i]);
+		if (!vqs[i]) {
+			err = -ENOMEM;
+			goto error;
+		}
+
+		vqs[i]->priv = lb;
+		lbvr->vq = vqs[i];
+	}
+
+	return 0;
+
+error:
+	rpmsg_lb_del_vqs(vdev);
+	return err;
+}
+
+/*
+ * no real use case for these handlers right now, but virtio expects us to
+ * provide them and otherwise crashes horribly.
+ */
+static u8 rpmsg_lb_get_status(struct virtio_device *vdev)
+{
+	return 0;
+}
+
+static void rpmsg_lb_set_status(struct virtio_device *vdev, u8 status)
+{
+}
+
+static void rpmsg_lb_reset(struct virtio_device *vdev)
+{
+}
+
+static u32 rpmsg_lb_get_features(struct virtio_device *vdev)
+{
+	return event_idx ? 1 << VIRTIO_RING_F_EVENT_IDX : 0;
+}
+
+static void rpmsg_lb_finalize_features(struct virtio_device *vdev)
+{
+	/* give vring a chance to accept features */
+	vring_transport_features(vdev);
+}
+
+static struct virtio_config_ops rpmsg_lb_config_ops = {
+	.get_features	= rpmsg_lb_get_features,
+	.finalize_features = rpmsg_lb_finalize_features,
+	.get		= rpmsg_lb_get,
+	.find_vqs	= rpmsg_lb_find_vqs,
+	.del_vqs	= rpmsg_lb_del_vqs,
+	.reset		= rpmsg_lb_reset,
+	.set_status	= rpmsg_lb_set_status,
+	.get_status	= rpmsg_lb_get_status,
+};
+
+/* the device is statically allocated */
+static void rpmsg_lb_release(struct device *dev)
+{
+}
+
+static struct rpmsg_lb_device rpmsg_lb = {
+	.vdev.id.device	= VIRTIO_ID_RPMSG,
+	.vdev.config	= &rpmsg_lb_config_ops,
+	.vdev.dev.release = rpmsg_lb_release,
+};
+
+static int __init rpmsg_lb_init(void)
+{
+	struct rpmsg_lb_device *lb = &rpmsg_lb;
+	int ret;
+
+	if (!num_bufs || !is_power_of_2(num_bufs) ||
+			buf_size <= sizeof(struct rpmsg_hdr) ||
+			buf_size - sizeof(struct rpmsg_hdr) > USHRT_MAX) {
+		pr_err("invalid buffers config: %u x %u\n", num_bufs, buf_size);
+		return -EINVAL;
+	}
+
+	if (!vq_pairs || !is_power_of_2(vq_pairs) ||
+			vq_pairs > RPMSG_MAX_VQ_PAIRS || vq_pairs > num_bufs) {
+		pr_err("invalid number of vring pairs: %u\n", vq_pairs);
+		return -EINVAL;
+	}
+
+	lb->bufs_size = 2 * num_bufs * buf_size;
+	lb->bufs = alloc_pages_exact(lb->bufs_size, GFP_KERNEL | __GFP_ZERO);
+	if (!lb->bufs)
+		return -ENOMEM;
+
+	lb->wq = create_singlethread_workqueue("rpmsg-lb");
+	if (!lb->wq) {
+		ret = -ENOMEM;
+		goto free_bufs;
+	}
+
+	INIT_WORK(&lb->work, rpmsg_lb_work);
+
+	ret = register_virtio_device(&lb->vdev);
+	if (ret) {
+		pr_err("failed to register the loopback device: %d\n", ret);
+		goto destroy_wq;
+	}
+
+	return 0;
+
+destroy_wq:
+	destroy_workqueue(lb->wq);
+free_bufs:
+	free_pages_exact(lb->bufs, lb->bufs_size);
+	return ret;
+}
+
+static void __exit rpmsg_lb_fini(void)
+{
+	struct rpmsg_lb_device *lb = &rpmsg_lb;
+
+	unregister_virtio_device(&lb->vdev);
+	destroy_workqueue(lb->wq);
+	free_pages_exact(lb->bufs, lb->bufs_size);
+}
+module_init(rpmsg_lb_init);
+module_exit(rpmsg_lb_fini);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Loopback remote processor messaging virtio device");
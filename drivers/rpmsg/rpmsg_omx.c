@@ -27,12 +27,34 @@
 #include <linux/jiffies.h>
 #include <linux/mutex.h>
 #include <linux/wait.h>
-#include <linux/skbuff.h>
 #include <linux/sched.h>
+#include <linux/err.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/aio.h>
+#include <linux/file.h>
+#include <linux/timer.h>
 
 /* maximum OMX devices this driver can handle */
 #define MAX_OMX_DEVICES		8
 
+/* maximum inbound messages an OMX instance may keep queued (power of 2) */
+#define OMX_RX_QUEUE_LEN	64
+
+/* upper bound for OMX_IOCBUSYPOLL, which otherwise hogs the cpu */
+#define OMX_MAX_BUSY_POLL_US	1000
+
+/* max number of entries in an OMX_IOC{SEND,RECV}BATCH/OMX_IOCCONNECTV call */
+#define OMX_MAX_BATCH		64
+
+/* how long the remote has to respond to a connection request */
+#define OMX_CONNECT_TIMEOUT_MS	5000
+
+/* limits of the shared rings set up by OMX_IOCRINGSETUP */
+#define OMX_RING_MAX_ENTRIES	1024
+#define OMX_RING_MIN_ENTRY_SIZE	32
+
 /**
  * enum omx_msg_types - various message types currently supported
  *
@@ -76,10 +98,18 @@ enum omx_error_codes {
 	OMX_NOMEM = 2,
 };
 
+/*
+ * OMX_CONNECTING: a connection request was sent, and we're waiting for the
+ * remote's response, which moves the instance to either OMX_CONNECTED or
+ * OMX_FAIL. if no response arrives in time, the instance moves to OMX_FAIL
+ * as well (see rpmsg_omx_connect_timeout()). state transitions are
+ * protected by the instance's state_lock
+ */
 enum omx_state {
 	OMX_UNCONNECTED,
 	OMX_CONNECTED,
 	OMX_FAIL,
+	OMX_CONNECTING,
 };
 
 /**
@@ -104,25 +134,61 @@ struct omx_conn_rsp {
 	u32 addr;
 } __packed;
 
+/*
+ * @writers: number of connected instances. an instance only reports POLLOUT
+ * when there are enough free TX buffers for each of them to send a message,
+ * so that waking up all the writers doesn't just make most of them fail
+ */
 struct rpmsg_omx_service {
 	struct cdev cdev;
 	struct device *dev;
 	struct rpmsg_channel *rpdev;
 	int minor;
+	atomic_t writers;
+};
+
+/**
+ * struct rpmsg_omx_msg - an inbound message waiting to be read
+ * @buf:	the rpmsg RX buffer holding the message, or NULL if the
+ *		message had to be copied into a private allocation
+ * @data:	the message payload
+ * @len:	length of the payload
+ */
+struct rpmsg_omx_msg {
+	void *buf;
+	char *data;
+	u32 len;
 };
 
 /* todo: let ept contain the connected destination addr, too ? */
 struct rpmsg_omx_instance {
 	struct rpmsg_omx_service *omxserv;
-	struct sk_buff_head queue;
+	/* inbound messages; rpmsg_omx_cb() is the only producer, and
+	 * readers serialize on @lock */
+	struct rpmsg_omx_msg *rx_ring;
+	unsigned int rx_head, rx_tail;
+	unsigned long rx_dropped;
 	struct mutex lock;
+	spinlock_t state_lock;
 	wait_queue_head_t waiting;
 	struct completion reply_arrived;
+	struct timer_list connect_timer;
 	struct rpmsg_endpoint *ept;
 	u32 dst;
 	int state;
+	int connect_err;
+	unsigned int busy_poll_us;
+	/* shared rings; our own copies of the indices and sizes are used,
+	 * since userspace may scribble over the shared ones */
+	void *ring_mem;
+	struct omx_ring *sq, *cq;
+	u32 sq_entries, cq_entries, entry_size;
+	u32 sq_head, cq_tail;
+	struct mutex sq_lock;
 };
 
+static const struct file_operations rpmsg_omx_fops;
+
 static struct class *rpmsg_omx_class;
 static dev_t rpmsg_omx_dev;
 
@@ -130,16 +196,148 @@ static dev_t rpmsg_omx_dev;
 static DEFINE_IDR(rpmsg_omx_services);
 static DEFINE_SPINLOCK(rpmsg_omx_services_lock);
 
+/* the entry of @ring at (free running) index @idx */
+static struct omx_ring_entry *rpmsg_omx_ring_entry(
+				struct rpmsg_omx_instance *omx,
+				struct omx_ring *ring, u32 entries, u32 idx)
+{
+	return (void *) ring->entries + (idx & (entries - 1)) * omx->entry_size;
+}
+
+/*
+ * copy an inbound message to the CQ. returns -EMSGSIZE if there's no CQ,
+ * or if the message doesn't fit in an entry, in which case it should be
+ * queued for read() instead. only called from rpmsg_omx_cb(), so the CQ
+ * has a single producer and needs no lock
+ */
+static int rpmsg_omx_cq_post(struct rpmsg_omx_instance *omx, void *data,
+								u32 len)
+{
+	struct omx_ring *cq = ACCESS_ONCE(omx->cq);
+	struct omx_ring_entry *entry;
+	u32 tail;
+
+	if (!cq)
+		return -EMSGSIZE;
+
+	/* pairs with the smp_wmb() in rpmsg_omx_ring_setup() */
+	smp_read_barrier_depends();
+	tail = omx->cq_tail;
+
+	if (len > omx->entry_size - sizeof(*entry))
+		return -EMSGSIZE;
+
+	if (tail - ACCESS_ONCE(cq->head) >= omx->cq_entries) {
+		cq->dropped++;
+		return -ENOSPC;
+	}
+
+	/* don't overwrite the entry before userspace is done reading it */
+	smp_mb();
+
+	entry = rpmsg_omx_ring_entry(omx, cq, omx->cq_entries, tail);
+	memcpy(entry->data, data, len);
+	entry->len = len;
+	entry->flags = 0;
+
+	/* the entry must be visible before the index that publishes it */
+	smp_wmb();
+	omx->cq_tail = ++tail;
+	cq->tail = tail;
+
+	return 0;
+}
+
+/* dispose of an inbound message once it has been consumed */
+static void rpmsg_omx_msg_free(struct rpmsg_channel *rpdev,
+						struct rpmsg_omx_msg *msg)
+{
+	if (msg->buf)
+		rpmsg_release_rx_buffer(rpdev, msg->buf);
+	else
+		kfree(msg->data);
+}
+
+static bool rpmsg_omx_rx_empty(struct rpmsg_omx_instance *omx)
+{
+	return ACCESS_ONCE(omx->rx_tail) == ACCESS_ONCE(omx->rx_head);
+}
+
+/*
+ * add an inbound message to the RX ring. the RX path delivers to us from
+ * one context at a time, so this is the only producer, and takes no lock.
+ * returns false if the ring is full
+ */
+static bool rpmsg_omx_rx_put(struct rpmsg_omx_instance *omx,
+						struct rpmsg_omx_msg *msg)
+{
+	unsigned int tail = omx->rx_tail;
+
+	if (tail - ACCESS_ONCE(omx->rx_head) >= OMX_RX_QUEUE_LEN) {
+		omx->rx_dropped++;
+		return false;
+	}
+
+	/* don't overwrite the slot before the reader is done with it */
+	smp_mb();
+
+	omx->rx_ring[tail & (OMX_RX_QUEUE_LEN - 1)] = *msg;
+
+	/* the slot must be visible before the index that publishes it */
+	smp_wmb();
+	omx->rx_tail = tail + 1;
+
+	return true;
+}
+
+/*
+ * take the next message off the RX ring. returns false if it's empty.
+ * must be called with omx->lock held, which serializes the readers
+ */
+static bool rpmsg_omx_rx_get(struct rpmsg_omx_instance *omx,
+						struct rpmsg_omx_msg *msg)
+{
+	unsigned int head = omx->rx_head;
+
+	if (head == ACCESS_ONCE(omx->rx_tail))
+		return false;
+
+	/* read the slot only after the index that published it */
+	smp_rmb();
+
+	*msg = omx->rx_ring[head & (OMX_RX_QUEUE_LEN - 1)];
+
+	/* we're done with the slot before the producer may reuse it */
+	smp_mb();
+	omx->rx_head = head + 1;
+
+	return true;
+}
+
+/*
+ * wake up readers. most of the time nobody is sleeping, so skip the wait
+ * queue lock altogether then; and since a woken reader leaves the queue,
+ * a burst of messages costs a single wakeup
+ */
+static void rpmsg_omx_wake_readers(struct rpmsg_omx_instance *omx)
+{
+	/* pairs with the barrier implied by prepare_to_wait() */
+	smp_mb();
+	if (waitqueue_active(&omx->waiting))
+		wake_up_interruptible(&omx->waiting);
+}
+
 static void rpmsg_omx_cb(struct rpmsg_channel *rpdev, void *data, int len,
 							void *priv, u32 src)
 {
 	struct omx_msg_hdr *hdr = data;
 	struct rpmsg_omx_instance *omx = priv;
 	struct omx_conn_rsp *rsp;
-	struct sk_buff *skb;
-	char *skbdata;
+	struct rpmsg_omx_msg msg;
+	unsigned long flags;
+	int ret;
 
-	if (len < sizeof(*hdr) || hdr->len < len - sizeof(*hdr)) {
+	if (len < sizeof(*hdr) || hdr->len > len - sizeof(*hdr)) {
 		dev_warn(&rpdev->dev, "%s: truncated message\n", __func__);
 		return;
 	}
@@ -158,24 +356,65 @@ static void rpmsg_omx_cb(struct rpmsg_channel *rpdev, void *data, int len,
 		rsp = (struct omx_conn_rsp *) hdr->data;
 		dev_dbg(&rpdev->dev, "conn rsp: status %d addr %d\n",
 			       rsp->status, rsp->addr);
-		omx->dst = rsp->addr;
-		omx->state = OMX_CONNECTED;
-		complete(&omx->reply_arrived);
+		spin_lock_irqsave(&omx->state_lock, flags);
+		/* ignore responses nobody is waiting for anymore */
+		if (omx->state == OMX_CONNECTING) {
+			del_timer(&omx->connect_timer);
+			omx->dst = rsp->addr;
+			if (rsp->status == OMX_SUCCESS) {
+				omx->state = OMX_CONNECTED;
+				atomic_inc(&omx->omxserv->writers);
+			} else {
+				omx->state = OMX_FAIL;
+				omx->connect_err = -ECONNREFUSED;
+			}
+			complete(&omx->reply_arrived);
+		}
+		spin_unlock_irqrestore(&omx->state_lock, flags);
+		/* non-blocking connects are waiting for this in poll() */
+		wake_up_interruptible(&omx->waiting);
 		break;
 	case OMX_RAW_MSG:
-		skb = alloc_skb(hdr->len, GFP_KERNEL);
-		if (!skb) {
-			dev_err(&rpdev->dev, "alloc_skb failed\n");
+		/* with shared rings, the CQ is where messages go */
+		ret = rpmsg_omx_cq_post(omx, hdr->data, hdr->len);
+		/* drops are counted in the CQ, don't flood the log */
+		if (ret == -ENOSPC && printk_ratelimit())
+			dev_err(&rpdev->dev, "CQ is full, dropping msg\n");
+		if (ret != -EMSGSIZE) {
+			rpmsg_omx_wake_readers(omx);
+			break;
+		}
+
+		msg.data = hdr->data;
+		msg.len = hdr->len;
+
+		/*
+		 * queue a reference to the rpmsg buffer itself, rather than
+		 * a copy of it. if rpmsg won't let us keep it (e.g. because
+		 * too many RX buffers are held already), copy after all, so
+		 * the buffer goes right back to the remote processor.
+		 */
+		msg.buf = data;
+		if (rpmsg_hold_rx_buffer(rpdev, data)) {
+			msg.buf = NULL;
+			msg.data = kmemdup(hdr->data, hdr->len, GFP_ATOMIC);
+			if (!msg.data) {
+				dev_err(&rpdev->dev, "kmemdup failed\n");
+				break;
+			}
+		}
+
+		if (!rpmsg_omx_rx_put(omx, &msg)) {
+			if (printk_ratelimit())
+				dev_err(&rpdev->dev,
+				"rx queue is full, dropped %lu msgs so far\n",
+							omx->rx_dropped);
+			rpmsg_omx_msg_free(rpdev, &msg);
 			break;
 		}
-		skbdata = skb_put(skb, hdr->len);
-		memcpy(skbdata, hdr->data, hdr->len);
 
-		mutex_lock(&omx->lock);
-		skb_queue_tail(&omx->queue, skb);
-		mutex_unlock(&omx->lock);
 		/* wake up any blocking processes, waiting for new data */
-		wake_up_interruptible(&omx->waiting);
+		rpmsg_omx_wake_readers(omx);
 		break;
 	default:
 		dev_warn(&rpdev->dev, "unexpected msg type: %d\n", hdr->type);
@@ -183,18 +422,51 @@ static void rpmsg_omx_cb(struct rpmsg_channel *rpdev, void *data, int len,
 	}
 }
 
-static int rpmsg_omx_connect(struct rpmsg_omx_instance *omx, char *omxname)
+/*
+ * the remote didn't respond to a connection request in time. fail it, so
+ * that poll() reports POLLERR, and the instance may try connecting again
+ */
+static void rpmsg_omx_connect_timeout(unsigned long data)
+{
+	struct rpmsg_omx_instance *omx = (struct rpmsg_omx_instance *) data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&omx->state_lock, flags);
+	if (omx->state == OMX_CONNECTING) {
+		omx->state = OMX_FAIL;
+		omx->connect_err = -ETIMEDOUT;
+		complete(&omx->reply_arrived);
+	}
+	spin_unlock_irqrestore(&omx->state_lock, flags);
+
+	wake_up_interruptible(&omx->waiting);
+}
+
+/* send a connection request, without waiting for the response */
+static int rpmsg_omx_connect_start(struct rpmsg_omx_instance *omx,
+							char *omxname)
 {
 	struct omx_msg_hdr *hdr;
 	struct omx_conn_req *payload;
 	struct rpmsg_omx_service *omxserv = omx->omxserv;
 	char connect_msg[sizeof(*hdr) + sizeof(*payload)] = { 0 };
-	int ret;
+	unsigned long flags;
+	int ret = 0;
 
+	spin_lock_irqsave(&omx->state_lock, flags);
 	if (omx->state == OMX_CONNECTED) {
 		dev_dbg(omxserv->dev, "endpoint already connected\n");
-		return -EISCONN;
+		ret = -EISCONN;
+	} else if (omx->state == OMX_CONNECTING) {
+		ret = -EALREADY;
+	} else {
+		init_completion(&omx->reply_arrived);
+		omx->state = OMX_CONNECTING;
 	}
+	spin_unlock_irqrestore(&omx->state_lock, flags);
+
+	if (ret)
+		return ret;
 
 	hdr = (struct omx_msg_hdr *)connect_msg;
 	hdr->type = OMX_CONN_REQ;
@@ -203,37 +475,389 @@ static int rpmsg_omx_connect(struct rpmsg_omx_instance *omx, char *omxname)
 	payload = (struct omx_conn_req *)hdr->data;
 	strcpy(payload->name, omxname);
 
-	init_completion(&omx->reply_arrived);
-
 	/* send a conn req to the remote OMX connection service. use
 	 * the new local address that was just allocated by ->open */
-	ret = rpmsg_send_offchannel(omxserv->rpdev, omx->ept->addr,
-			omxserv->rpdev->dst, connect_msg, sizeof(connect_msg));
+	ret = rpmsg_send_offchannel_prio(omxserv->rpdev, omx->ept->addr,
+			omxserv->rpdev->dst, connect_msg, sizeof(connect_msg),
+			RPMSG_SEND_TIMEOUT);
 	if (ret) {
 		dev_err(omxserv->dev, "rpmsg_send failed: %d\n", ret);
+		spin_lock_irqsave(&omx->state_lock, flags);
+		omx->state = OMX_UNCONNECTED;
+		spin_unlock_irqrestore(&omx->state_lock, flags);
 		return ret;
 	}
 
-	/* wait until a connection reply arrives or 5 seconds elapse */
+	/* if the response arrived already, the timer won't do anything */
+	mod_timer(&omx->connect_timer,
+			jiffies + msecs_to_jiffies(OMX_CONNECT_TIMEOUT_MS));
+
+	return 0;
+}
+
+/* wait up to @timeout jiffies for the response to a connection request */
+static int rpmsg_omx_connect_wait(struct rpmsg_omx_instance *omx,
+							long timeout)
+{
+	struct rpmsg_omx_service *omxserv = omx->omxserv;
+	unsigned long flags;
+	long ret;
+	int err;
+
 	ret = wait_for_completion_interruptible_timeout(&omx->reply_arrived,
-						msecs_to_jiffies(5000));
-	if (omx->state == OMX_CONNECTED)
-		return 0;
+								timeout);
 
-	if (ret) {
-		dev_err(omxserv->dev, "premature wakeup: %d\n", ret);
-		return -EIO;
+	spin_lock_irqsave(&omx->state_lock, flags);
+	switch (omx->state) {
+	case OMX_CONNECTED:
+		err = 0;
+		break;
+	case OMX_FAIL:
+		err = omx->connect_err;
+		break;
+	default:
+		/* give up on this request; a late response will be ignored */
+		del_timer(&omx->connect_timer);
+		omx->state = OMX_UNCONNECTED;
+		if (ret) {
+			dev_err(omxserv->dev, "premature wakeup: %ld\n", ret);
+			err = -EIO;
+		} else {
+			err = -ETIMEDOUT;
+		}
+	}
+	spin_unlock_irqrestore(&omx->state_lock, flags);
+
+	return err;
+}
+
+/*
+ * connect to the remote OMX service @omxname. if @nonblock is set, this
+ * returns -EINPROGRESS right away, and poll() then reports POLLOUT once the
+ * connection is established, or POLLERR if it was refused or timed out
+ */
+static int rpmsg_omx_connect(struct rpmsg_omx_instance *omx, char *omxname,
+								bool nonblock)
+{
+	int ret;
+
+	ret = rpmsg_omx_connect_start(omx, omxname);
+	if (ret)
+		return ret;
+
+	if (nonblock)
+		return -EINPROGRESS;
+
+	/* wait until a connection reply arrives, or the request times out */
+	return rpmsg_omx_connect_wait(omx,
+				msecs_to_jiffies(OMX_CONNECT_TIMEOUT_MS));
+}
+
+/*
+ * connect several instances (each one identified by its file descriptor)
+ * at once: all the connection requests are sent first, and only then are
+ * the responses waited for (unless @filp is non-blocking)
+ */
+static int rpmsg_omx_connectv(struct file *filp,
+				struct omx_connv __user *uconnv)
+{
+	bool nonblock = filp->f_flags & O_NONBLOCK;
+	unsigned long deadline = jiffies +
+				msecs_to_jiffies(OMX_CONNECT_TIMEOUT_MS);
+	struct rpmsg_omx_instance *omx;
+	struct omx_connv_req *reqs;
+	struct omx_connv connv;
+	void __user *ureqs;
+	struct file **files;
+	long timeout;
+	int i, ret = 0;
+
+	if (copy_from_user(&connv, uconnv, sizeof(connv)))
+		return -EFAULT;
+
+	if (!connv.count || connv.count > OMX_MAX_BATCH || connv.reserved)
+		return -EINVAL;
+
+	ureqs = (void __user *) (uintptr_t) connv.reqs;
+
+	reqs = kmalloc(connv.count * sizeof(*reqs), GFP_KERNEL);
+	files = kcalloc(connv.count, sizeof(*files), GFP_KERNEL);
+	if (!reqs || !files) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(reqs, ureqs, connv.count * sizeof(*reqs))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < connv.count; i++) {
+		files[i] = fget(reqs[i].fd);
+		if (!files[i] || files[i]->f_op != &rpmsg_omx_fops) {
+			reqs[i].status = -EBADF;
+			continue;
+		}
+
+		/* make sure user input is null terminated */
+		reqs[i].name[sizeof(reqs[i].name) - 1] = '\0';
+		reqs[i].status = rpmsg_omx_connect_start(
+					files[i]->private_data, reqs[i].name);
+		if (!reqs[i].status && nonblock)
+			reqs[i].status = -EINPROGRESS;
+	}
+
+	/* the responses are all waited for together, up to the timeout */
+	for (i = 0; i < connv.count && !nonblock; i++) {
+		if (reqs[i].status)
+			continue;
+
+		omx = files[i]->private_data;
+		timeout = max_t(long, (long) (deadline - jiffies), 0);
+		reqs[i].status = rpmsg_omx_connect_wait(omx, timeout);
+	}
+
+	if (copy_to_user(ureqs, reqs, connv.count * sizeof(*reqs)))
+		ret = -EFAULT;
+
+out:
+	for (i = 0; files && i < connv.count; i++)
+		if (files[i])
+			fput(files[i]);
+	kfree(files);
+	kfree(reqs);
+	return ret;
+}
+
+/* send a latency-sensitive message, ahead of the bulk data */
+static int rpmsg_omx_send_prio(struct rpmsg_omx_instance *omx,
+					struct omx_prio_msg __user *umsg)
+{
+	struct rpmsg_omx_service *omxserv = omx->omxserv;
+	struct omx_prio_msg pmsg;
+	struct omx_msg_hdr *hdr;
+	int ret;
+
+	if (omx->state != OMX_CONNECTED)
+		return -ENOTCONN;
+
+	if (copy_from_user(&pmsg, umsg, sizeof(pmsg)))
+		return -EFAULT;
+
+	if (pmsg.reserved)
+		return -EINVAL;
+
+	/* high priority messages can't be fragmented */
+	if (pmsg.len > rpmsg_get_max_payload(omxserv->rpdev) - sizeof(*hdr))
+		return -EMSGSIZE;
+
+	hdr = kmalloc(sizeof(*hdr) + pmsg.len, GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+
+	if (copy_from_user(hdr->data, (void __user *) (uintptr_t) pmsg.data,
+								pmsg.len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	hdr->type = OMX_RAW_MSG;
+	hdr->flags = 0;
+	hdr->len = pmsg.len;
+
+	ret = rpmsg_send_offchannel_prio(omxserv->rpdev, omx->ept->addr,
+				omx->dst, hdr, sizeof(*hdr) + pmsg.len,
+				RPMSG_SEND_TIMEOUT);
+	if (ret)
+		dev_err(omxserv->dev, "rpmsg_send_prio failed: %d\n", ret);
+
+out:
+	kfree(hdr);
+	return ret;
+}
+
+/* allocate the shared rings, which userspace will then mmap() */
+static int rpmsg_omx_ring_setup(struct rpmsg_omx_instance *omx,
+				struct omx_ring_params __user *uparams)
+{
+	struct omx_ring_params params;
+	size_t sq_size, cq_size;
+	u32 max_entry_size;
+	void *mem;
+	int ret = 0;
+
+	if (copy_from_user(&params, uparams, sizeof(params)))
+		return -EFAULT;
+
+	/* any SQ entry must fit in a single TX buffer */
+	max_entry_size = rpmsg_get_max_payload(omx->omxserv->rpdev) -
+				sizeof(struct omx_msg_hdr) +
+				sizeof(struct omx_ring_entry);
+
+	if (!is_power_of_2(params.sq_entries) ||
+			!is_power_of_2(params.cq_entries) ||
+			!is_power_of_2(params.entry_size) ||
+			params.sq_entries > OMX_RING_MAX_ENTRIES ||
+			params.cq_entries > OMX_RING_MAX_ENTRIES ||
+			params.entry_size < OMX_RING_MIN_ENTRY_SIZE ||
+			params.entry_size > max_entry_size ||
+			params.entry_size > PAGE_SIZE)
+		return -EINVAL;
+
+	sq_size = sizeof(struct omx_ring) +
+				params.sq_entries * params.entry_size;
+	cq_size = sizeof(struct omx_ring) +
+				params.cq_entries * params.entry_size;
+
+	params.sq_off = 0;
+	params.cq_off = PAGE_ALIGN(sq_size);
+	params.size = params.cq_off + PAGE_ALIGN(cq_size);
+
+	/*
+	 * don't hand out parameters of rings that won't be set up. this is
+	 * checked again below, in case of a concurrent setup; omx->lock
+	 * can't be held across copy_to_user(), as mmap() takes it as well
+	 */
+	mutex_lock(&omx->lock);
+	ret = omx->ring_mem ? -EBUSY : 0;
+	mutex_unlock(&omx->lock);
+	if (ret)
+		return ret;
+
+	if (copy_to_user(uparams, &params, sizeof(params)))
+		return -EFAULT;
+
+	/* zeroed, so both rings start out empty */
+	mem = vmalloc_user(params.size);
+	if (!mem)
+		return -ENOMEM;
+
+	mutex_lock(&omx->lock);
+
+	if (omx->ring_mem) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	omx->ring_mem = mem;
+	omx->sq_entries = params.sq_entries;
+	omx->cq_entries = params.cq_entries;
+	omx->entry_size = params.entry_size;
+	omx->sq_head = 0;
+	omx->cq_tail = 0;
+
+	/*
+	 * rpmsg_omx_cb() looks at the CQ without taking omx->lock, so the
+	 * ring parameters must be visible before the rings themselves
+	 */
+	smp_wmb();
+	omx->sq = mem + params.sq_off;
+	omx->cq = mem + params.cq_off;
+	mem = NULL;
+
+out:
+	mutex_unlock(&omx->lock);
+	vfree(mem);
+	return ret;
+}
+
+/*
+ * send all the messages userspace queued in the SQ. invalid entries are
+ * flagged and skipped, so that they don't stall the ones behind them.
+ * returns how many were sent, or an error if none could be
+ */
+static int rpmsg_omx_ring_kick(struct rpmsg_omx_instance *omx, long timeout)
+{
+	struct rpmsg_omx_service *omxserv = omx->omxserv;
+	struct omx_ring *sq = omx->sq;
+	struct omx_ring_entry *entry;
+	struct omx_msg_hdr *hdr;
+	u32 head, tail, len;
+	int size, sent = 0, ret = 0;
+
+	if (!sq)
+		return -EINVAL;
+
+	if (omx->state != OMX_CONNECTED)
+		return -ENOTCONN;
+
+	if (mutex_lock_interruptible(&omx->sq_lock))
+		return -ERESTARTSYS;
+
+	head = omx->sq_head;
+	tail = ACCESS_ONCE(sq->tail);
+	if (tail - head > omx->sq_entries) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* read the entries only after having seen the index that published
+	 * them */
+	smp_rmb();
+
+	for (; head != tail; head++) {
+		entry = rpmsg_omx_ring_entry(omx, sq, omx->sq_entries, head);
+		len = ACCESS_ONCE(entry->len);
+		if (len > omx->entry_size - sizeof(*entry)) {
+			entry->flags = OMX_RING_F_INVALID;
+			ret = -EINVAL;
+			continue;
+		}
+
+		hdr = rpmsg_get_tx_buffer(omxserv->rpdev, omx->ept->addr,
+							&size, timeout);
+		if (IS_ERR(hdr)) {
+			ret = PTR_ERR(hdr);
+			break;
+		}
+
+		/* can't happen, given the entry size limit of the setup */
+		if (WARN_ON(len > size - sizeof(*hdr))) {
+			rpmsg_put_tx_buffer(omxserv->rpdev, hdr);
+			entry->flags = OMX_RING_F_INVALID;
+			ret = -EMSGSIZE;
+			continue;
+		}
+
+		memcpy(hdr->data, entry->data, len);
+		hdr->type = OMX_RAW_MSG;
+		hdr->flags = 0;
+		hdr->len = len;
+
+		ret = rpmsg_queue_offchannel_nocopy(omxserv->rpdev,
+				omx->ept->addr, omx->dst, hdr,
+				sizeof(*hdr) + len);
+		if (ret)
+			break;
+
+		entry->flags = 0;
+		sent++;
 	}
 
-	return -ETIMEDOUT;
+	/* a single kick for the whole batch */
+	rpmsg_kick(omxserv->rpdev);
+
+	/* we're done with the entries; let userspace reuse them */
+	smp_mb();
+	omx->sq_head = head;
+	sq->head = head;
+
+out:
+	mutex_unlock(&omx->sq_lock);
+	return sent ? sent : ret;
 }
 
+static int rpmsg_omx_batch(struct rpmsg_omx_instance *omx,
+				struct omx_batch __user *ubatch, bool send,
+				bool nonblock);
+
 static
 long rpmsg_omx_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct rpmsg_omx_instance *omx = filp->private_data;
 	struct rpmsg_omx_service *omxserv = omx->omxserv;
 	char buf[48];
+	u32 usecs;
 	int ret = 0;
 
 	dev_dbg(omxserv->dev, "%s: cmd %d, arg 0x%lx\n", __func__, cmd, arg);
@@ -253,7 +877,42 @@ long rpmsg_omx_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		/* make sure user input is null terminated */
 		buf[sizeof(buf) - 1] = '\0';
-		ret = rpmsg_omx_connect(omx, buf);
+		ret = rpmsg_omx_connect(omx, buf,
+					filp->f_flags & O_NONBLOCK);
+		break;
+	case OMX_IOCCONNECTV:
+		ret = rpmsg_omx_connectv(filp, (struct omx_connv __user *) arg);
+		break;
+	case OMX_IOCSENDPRIO:
+		ret = rpmsg_omx_send_prio(omx,
+				(struct omx_prio_msg __user *) arg);
+		break;
+	case OMX_IOCBUSYPOLL:
+		if (get_user(usecs, (u32 __user *) arg)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (usecs > OMX_MAX_BUSY_POLL_US) {
+			ret = -EINVAL;
+			break;
+		}
+		omx->busy_poll_us = usecs;
+		break;
+	case OMX_IOCSENDBATCH:
+	case OMX_IOCRECVBATCH:
+		ret = rpmsg_omx_batch(omx, (struct omx_batch __user *) arg,
+				cmd == OMX_IOCSENDBATCH,
+				filp->f_flags & O_NONBLOCK);
+		break;
+	case OMX_IOCRINGSETUP:
+		ret = rpmsg_omx_ring_setup(omx,
+				(struct omx_ring_params __user *) arg);
+		break;
+	case OMX_IOCRINGKICK:
+		ret = rpmsg_omx_ring_kick(omx, filp->f_flags & O_NONBLOCK ?
+						0 : MAX_SCHEDULE_TIMEOUT);
+		if (ret == -ENOMEM && filp->f_flags & O_NONBLOCK)
+			ret = -EAGAIN;
 		break;
 	default:
 		dev_warn(omxserv->dev, "unhandled ioctl cmd: %d\n", cmd);
@@ -274,9 +933,19 @@ static int rpmsg_omx_open(struct inode *inode, struct file *filp)
 	if (!omx)
 		return -ENOMEM;
 
+	omx->rx_ring = kcalloc(OMX_RX_QUEUE_LEN, sizeof(*omx->rx_ring),
+								GFP_KERNEL);
+	if (!omx->rx_ring) {
+		kfree(omx);
+		return -ENOMEM;
+	}
+
 	mutex_init(&omx->lock);
-	skb_queue_head_init(&omx->queue);
+	spin_lock_init(&omx->state_lock);
+	mutex_init(&omx->sq_lock);
 	init_waitqueue_head(&omx->waiting);
+	setup_timer(&omx->connect_timer, rpmsg_omx_connect_timeout,
+						(unsigned long) omx);
 	omx->omxserv = omxserv;
 	omx->state = OMX_UNCONNECTED;
 
@@ -285,6 +954,7 @@ static int rpmsg_omx_open(struct inode *inode, struct file *filp)
 							RPMSG_ADDR_ANY);
 	if (!omx->ept) {
 		dev_err(omxserv->dev, "create ept failed\n");
+		kfree(omx->rx_ring);
 		kfree(omx);
 		return -ENOMEM;
 	}
@@ -303,6 +973,7 @@ static int rpmsg_omx_release(struct inode *inode, struct file *filp)
 	struct rpmsg_omx_service *omxserv = omx->omxserv;
 	char kbuf[512];
 	struct omx_msg_hdr *hdr = (struct omx_msg_hdr *) kbuf;
+	struct rpmsg_omx_msg msg;
 	int use, ret;
 
 	/* todo: release resources here */
@@ -313,85 +984,235 @@ static int rpmsg_omx_release(struct inode *inode, struct file *filp)
 	hdr->len = 0;
 	use = sizeof(*hdr);
 
-	ret = rpmsg_send_offchannel(omxserv->rpdev, omx->ept->addr,
-						omx->dst, kbuf, use);
+	ret = rpmsg_send_offchannel_prio(omxserv->rpdev, omx->ept->addr,
+					omx->dst, kbuf, use, RPMSG_SEND_TIMEOUT);
 	if (ret) {
 		dev_err(omxserv->dev, "rpmsg_send failed: %d\n", ret);
 		return ret;
 	}
 
 	rpmsg_destroy_ept(omx->ept);
+	del_timer_sync(&omx->connect_timer);
+
+	if (omx->state == OMX_CONNECTED)
+		atomic_dec(&omxserv->writers);
+
+	/* give back any unread messages */
+	while (rpmsg_omx_rx_get(omx, &msg))
+		rpmsg_omx_msg_free(omxserv->rpdev, &msg);
+	kfree(omx->rx_ring);
+
+	vfree(omx->ring_mem);
 	kfree(omx);
 
 	return 0;
 }
 
-static ssize_t rpmsg_omx_read(struct file *filp, char __user *buf,
-						size_t len, loff_t *offp)
+static bool rpmsg_omx_has_msg(void *data)
 {
-	struct rpmsg_omx_instance *omx = filp->private_data;
-	struct sk_buff *skb;
-	int use;
+	struct rpmsg_omx_instance *omx = data;
 
-	if (omx->state != OMX_CONNECTED)
-		return -ENOTCONN;
+	return !rpmsg_omx_rx_empty(omx);
+}
+
+/*
+ * take the next inbound message off the queue. unless @nonblock is set,
+ * wait for one if there's none yet
+ */
+static int rpmsg_omx_dequeue(struct rpmsg_omx_instance *omx,
+				struct rpmsg_omx_msg *msg, bool nonblock)
+{
+	bool ret;
 
 	if (mutex_lock_interruptible(&omx->lock))
 		return -ERESTARTSYS;
 
 	/* nothing to read ? */
-	if (skb_queue_empty(&omx->queue)) {
+	if (rpmsg_omx_rx_empty(omx)) {
 		mutex_unlock(&omx->lock);
 		/* non-blocking requested ? return now */
-		if (filp->f_flags & O_NONBLOCK)
+		if (nonblock)
 			return -EAGAIN;
+		/* poll for a bit first, if we were asked to */
+		if (omx->busy_poll_us)
+			rpmsg_busy_poll(omx->omxserv->rpdev, omx->busy_poll_us,
+						rpmsg_omx_has_msg, omx);
 		/* otherwise block, and wait for data */
 		if (wait_event_interruptible(omx->waiting,
-				!skb_queue_empty(&omx->queue)))
+				!rpmsg_omx_rx_empty(omx)))
 			return -ERESTARTSYS;
 		if (mutex_lock_interruptible(&omx->lock))
 			return -ERESTARTSYS;
 	}
 
-	skb = skb_dequeue(&omx->queue);
-	if (!skb) {
+	ret = rpmsg_omx_rx_get(omx, msg);
+
+	mutex_unlock(&omx->lock);
+
+	if (!ret) {
 		dev_err(omx->omxserv->dev, "err is rmpsg_omx racy ?\n");
 		return -EFAULT;
 	}
 
-	mutex_unlock(&omx->lock);
+	return 0;
+}
 
-	use = min(len, skb->len);
+/* copy out (up to @len bytes of) a dequeued message, and dispose of it */
+static ssize_t rpmsg_omx_copy_msg(struct rpmsg_omx_instance *omx,
+			struct rpmsg_omx_msg *msg, char __user *buf, size_t len)
+{
+	ssize_t use = min(len, (size_t) msg->len);
 
-	if (copy_to_user(buf, skb->data, use))
+	/* copy straight out of the rpmsg buffer, and only then release it */
+	if (copy_to_user(buf, msg->data, use))
 		use = -EFAULT;
 
-	kfree_skb(skb);
+	rpmsg_omx_msg_free(omx->omxserv->rpdev, msg);
 	return use;
 }
 
-/* todo: block when no rpmsg buffer is available
- * (actually should happen in rpmsg) */
-static ssize_t rpmsg_omx_write(struct file *filp, const char __user *ubuf,
+static ssize_t rpmsg_omx_read(struct file *filp, char __user *buf,
 						size_t len, loff_t *offp)
 {
 	struct rpmsg_omx_instance *omx = filp->private_data;
-	struct rpmsg_omx_service *omxserv = omx->omxserv;
-	char kbuf[512];
-	struct omx_msg_hdr *hdr = (struct omx_msg_hdr *) kbuf;
-	int use, ret;
+	struct rpmsg_omx_msg msg;
+	int ret;
+
+	if (omx->state != OMX_CONNECTED)
+		return -ENOTCONN;
+
+	ret = rpmsg_omx_dequeue(omx, &msg, filp->f_flags & O_NONBLOCK);
+	if (ret)
+		return ret;
+
+	return rpmsg_omx_copy_msg(omx, &msg, buf, len);
+}
+
+/*
+ * readv(): each iovec receives one message (truncated to the iovec's size).
+ * only the first message is waited for. use OMX_IOCRECVBATCH to also learn
+ * the length of each message
+ */
+static ssize_t rpmsg_omx_aio_read(struct kiocb *iocb, const struct iovec *iov,
+					unsigned long nr_segs, loff_t pos)
+{
+	struct rpmsg_omx_instance *omx = iocb->ki_filp->private_data;
+	bool nonblock = iocb->ki_filp->f_flags & O_NONBLOCK;
+	struct rpmsg_omx_msg msg;
+	ssize_t use, total = 0;
+	unsigned long i;
+	int ret = 0;
 
 	if (omx->state != OMX_CONNECTED)
 		return -ENOTCONN;
 
+	for (i = 0; i < nr_segs; i++) {
+		ret = rpmsg_omx_dequeue(omx, &msg, nonblock || i);
+		if (ret)
+			break;
+
+		use = rpmsg_omx_copy_msg(omx, &msg, iov[i].iov_base,
+							iov[i].iov_len);
+		if (use < 0) {
+			ret = use;
+			break;
+		}
+
+		total += use;
+	}
+
+	return total ? total : ret;
+}
+
+/*
+ * messages that don't fit in a single rpmsg buffer are first copied to
+ * a bounce buffer, and then fragmented by rpmsg
+ */
+static ssize_t rpmsg_omx_write_large(struct rpmsg_omx_instance *omx,
+				const char __user *ubuf, size_t len, long timeout)
+{
+	struct rpmsg_omx_service *omxserv = omx->omxserv;
+	struct omx_msg_hdr hdr;
+	struct kvec iov[2];
+	void *data;
+	int ret;
+
+	if (len > RPMSG_MAX_MSG_SIZE - sizeof(hdr))
+		return -EMSGSIZE;
+
+	data = kmalloc(len, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	if (copy_from_user(data, ubuf, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	hdr.type = OMX_RAW_MSG;
+	hdr.flags = 0;
+	hdr.len = len;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+
+	ret = rpmsg_sendv_offchannel(omxserv->rpdev, omx->ept->addr, omx->dst,
+							iov, 2, timeout);
+	if (ret) {
+		dev_err(omxserv->dev, "rpmsg_sendv failed: %d\n", ret);
+		goto out;
+	}
+
+	ret = len + sizeof(hdr);
+out:
+	kfree(data);
+	return ret;
+}
+
+/*
+ * queue a message for the remote OMX instance, without kicking the remote
+ * processor about it: the caller must call rpmsg_kick() once it has queued
+ * all of its messages. returns the number of bytes queued, header included
+ */
+static ssize_t rpmsg_omx_queue(struct rpmsg_omx_instance *omx,
+				const char __user *ubuf, size_t len, long timeout)
+{
+	struct rpmsg_omx_service *omxserv = omx->omxserv;
+	struct omx_msg_hdr *hdr;
+	int use, size, ret;
+
 	/*
-	 * for now, limit msg size to 512 bytes (incl. header).
-	 * (note: rpmsg's limit is even tighter. this whole thing needs fixing)
+	 * build the message directly in an rpmsg buffer, so user data is
+	 * copied only once. if no rpmsg buffer is available, either block
+	 * or bail out.
 	 */
-	use = min(sizeof(kbuf) - sizeof(*hdr), len);
+	hdr = rpmsg_get_tx_buffer(omxserv->rpdev, omx->ept->addr, &size,
+								timeout);
+	if (IS_ERR(hdr)) {
+		ret = PTR_ERR(hdr);
+		if (ret == -ENOMEM && !timeout)
+			return -EAGAIN;
+		dev_err(omxserv->dev, "rpmsg_get_tx_buffer failed: %d\n", ret);
+		return ret;
+	}
 
-	if (copy_from_user(hdr->data, ubuf, use))
-		return -EMSGSIZE;
+	/* too big for a single buffer ? let rpmsg fragment it */
+	if (len > size - sizeof(*hdr)) {
+		rpmsg_put_tx_buffer(omxserv->rpdev, hdr);
+		ret = rpmsg_omx_write_large(omx, ubuf, len, timeout);
+		if (ret == -ENOMEM && !timeout)
+			return -EAGAIN;
+		return ret;
+	}
+
+	use = len;
+
+	if (copy_from_user(hdr->data, ubuf, use)) {
+		rpmsg_put_tx_buffer(omxserv->rpdev, hdr);
+		return -EFAULT;
+	}
 
 	hdr->type = OMX_RAW_MSG;
 	hdr->flags = 0;
@@ -399,8 +1220,8 @@ static ssize_t rpmsg_omx_write(struct file *filp, const char __user *ubuf,
 
 	use += sizeof(*hdr);
 
-	ret = rpmsg_send_offchannel(omxserv->rpdev, omx->ept->addr,
-						omx->dst, kbuf, use);
+	ret = rpmsg_queue_offchannel_nocopy(omxserv->rpdev, omx->ept->addr,
+							omx->dst, hdr, use);
 	if (ret) {
 		dev_err(omxserv->dev, "rpmsg_send failed: %d\n", ret);
 		return ret;
@@ -409,6 +1230,126 @@ static ssize_t rpmsg_omx_write(struct file *filp, const char __user *ubuf,
 	return use;
 }
 
+static ssize_t rpmsg_omx_write(struct file *filp, const char __user *ubuf,
+						size_t len, loff_t *offp)
+{
+	struct rpmsg_omx_instance *omx = filp->private_data;
+	long timeout = filp->f_flags & O_NONBLOCK ? 0 : MAX_SCHEDULE_TIMEOUT;
+	ssize_t ret;
+
+	if (omx->state != OMX_CONNECTED)
+		return -ENOTCONN;
+
+	ret = rpmsg_omx_queue(omx, ubuf, len, timeout);
+	rpmsg_kick(omx->omxserv->rpdev);
+
+	return ret;
+}
+
+/*
+ * writev(): each iovec is sent as one message, and the remote processor
+ * is kicked only once for the whole lot
+ */
+static ssize_t rpmsg_omx_aio_write(struct kiocb *iocb, const struct iovec *iov,
+					unsigned long nr_segs, loff_t pos)
+{
+	struct rpmsg_omx_instance *omx = iocb->ki_filp->private_data;
+	long timeout = iocb->ki_filp->f_flags & O_NONBLOCK ? 0 :
+							MAX_SCHEDULE_TIMEOUT;
+	ssize_t ret = 0, total = 0;
+	unsigned long i;
+
+	if (omx->state != OMX_CONNECTED)
+		return -ENOTCONN;
+
+	for (i = 0; i < nr_segs; i++) {
+		ret = rpmsg_omx_queue(omx, iov[i].iov_base, iov[i].iov_len,
+								timeout);
+		if (ret < 0)
+			break;
+
+		total += iov[i].iov_len;
+	}
+
+	rpmsg_kick(omx->omxserv->rpdev);
+
+	return total ? total : ret;
+}
+
+/*
+ * send or receive an array of messages in one go, see struct omx_batch.
+ * returns the number of messages that were sent or received
+ */
+static int rpmsg_omx_batch(struct rpmsg_omx_instance *omx,
+				struct omx_batch __user *ubatch, bool send,
+				bool nonblock)
+{
+	long timeout = nonblock ? 0 : MAX_SCHEDULE_TIMEOUT;
+	struct omx_batch_msg *msgs;
+	struct omx_batch batch;
+	struct rpmsg_omx_msg msg;
+	void __user *umsgs, *data;
+	ssize_t use;
+	int i, ret;
+
+	if (omx->state != OMX_CONNECTED)
+		return -ENOTCONN;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > OMX_MAX_BATCH || batch.reserved)
+		return -EINVAL;
+
+	umsgs = (void __user *) (uintptr_t) batch.msgs;
+
+	msgs = kmalloc(batch.count * sizeof(*msgs), GFP_KERNEL);
+	if (!msgs)
+		return -ENOMEM;
+
+	if (copy_from_user(msgs, umsgs, batch.count * sizeof(*msgs))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		data = (void __user *) (uintptr_t) msgs[i].data;
+
+		if (send) {
+			use = rpmsg_omx_queue(omx, data, msgs[i].len, timeout);
+			msgs[i].status = use < 0 ? use : 0;
+		} else {
+			/* only the first message is waited for */
+			use = rpmsg_omx_dequeue(omx, &msg, nonblock || i);
+			if (!use) {
+				/* report the full length, even if truncated */
+				msgs[i].status = msg.len;
+				use = rpmsg_omx_copy_msg(omx, &msg, data,
+								msgs[i].len);
+			}
+			if (use < 0)
+				msgs[i].status = use;
+		}
+
+		if (use < 0)
+			break;
+	}
+
+	if (send)
+		rpmsg_kick(omx->omxserv->rpdev);
+
+	/* the status of the message that failed, if any, is reported too */
+	if (copy_to_user(umsgs, msgs,
+				min_t(u32, i + 1, batch.count) * sizeof(*msgs)))
+		ret = -EFAULT;
+	else
+		ret = i ? i : use;
+
+out:
+	kfree(msgs);
+	return ret;
+}
+
 static
 unsigned int rpmsg_poll(struct file *filp, struct poll_table_struct *wait)
 {
@@ -420,11 +1361,21 @@ unsigned int rpmsg_poll(struct file *filp, struct poll_table_struct *wait)
 
 	poll_wait(filp, &omx->waiting, wait);
 
-	if (!skb_queue_empty(&omx->queue))
+	if (!rpmsg_omx_rx_empty(omx))
 		mask |= POLLIN | POLLRDNORM;
 
-	/* implement missing rpmsg virtio functionality here */
-	if (true)
+	if (omx->cq &&
+		ACCESS_ONCE(omx->cq_tail) != ACCESS_ONCE(omx->cq->head))
+		mask |= POLLIN | POLLRDNORM;
+
+	/* a non-blocking connect that was refused */
+	if (omx->state == OMX_FAIL)
+		mask |= POLLERR;
+
+	/* writable only if a message can be sent without blocking */
+	if (omx->state == OMX_CONNECTED &&
+			rpmsg_poll_tx(omx->omxserv->rpdev, omx->ept->addr,
+				filp, wait, atomic_read(&omx->omxserv->writers)))
 		mask |= POLLOUT | POLLWRNORM;
 
 	mutex_unlock(&omx->lock);
@@ -432,13 +1383,30 @@ unsigned int rpmsg_poll(struct file *filp, struct poll_table_struct *wait)
 	return mask;
 }
 
+/* map the shared rings set up by OMX_IOCRINGSETUP */
+static int rpmsg_omx_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct rpmsg_omx_instance *omx = filp->private_data;
+	int ret;
+
+	mutex_lock(&omx->lock);
+	ret = omx->ring_mem ? remap_vmalloc_range(vma, omx->ring_mem,
+						vma->vm_pgoff) : -EINVAL;
+	mutex_unlock(&omx->lock);
+
+	return ret;
+}
+
 static const struct file_operations rpmsg_omx_fops = {
 	.open		= rpmsg_omx_open,
 	.release	= rpmsg_omx_release,
 	.unlocked_ioctl	= rpmsg_omx_ioctl,
 	.read		= rpmsg_omx_read,
 	.write		= rpmsg_omx_write,
+	.aio_read	= rpmsg_omx_aio_read,
+	.aio_write	= rpmsg_omx_aio_write,
 	.poll		= rpmsg_poll,
+	.mmap		= rpmsg_omx_mmap,
 	.owner		= THIS_MODULE,
 };
 
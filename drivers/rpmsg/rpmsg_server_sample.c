@@ -41,8 +41,8 @@ static void rpmsg_sample_cb(struct rpmsg_channel *rpdev, void *data, int len,
 		return;
 	}
 
-	/* reply */
-	err = rpmsg_sendto(rpdev, MSG, strlen(MSG), src);
+	/* reply (we're in the callback, so don't sleep) */
+	err = rpmsg_trysendto(rpdev, MSG, strlen(MSG), src);
 	if (err)
 		pr_err("rpmsg_send failed: %d\n", err);
 }
@@ -21,20 +21,39 @@
 #include <linux/virtio_config.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
+#include <linux/err.h>
 #include <linux/rpmsg.h>
 #include <linux/idr.h>
 #include <linux/radix-tree.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/poll.h>
 
 #include "rpmsg_internal.h"
 
-struct rpmsg_hdr {
-	u16 len;
-	u16 flags;
-	u32 src;
-	u32 dst;
-	u32 unused;
-	u8 data[0];
-} __packed;
+#define CREATE_TRACE_POINTS
+#include <trace/events/rpmsg.h>
+
+/* the mailbox events are emitted by the platform-specific transports */
+EXPORT_TRACEPOINT_SYMBOL_GPL(rpmsg_mbox_tx);
+EXPORT_TRACEPOINT_SYMBOL_GPL(rpmsg_mbox_rx);
+
+/*
+ * Messages that don't fit in a single buffer are sent as a sequence of
+ * fragments, all carrying RPMSG_F_FRAG. The first and the last fragments
+ * are also marked with RPMSG_F_FRAG_FIRST and RPMSG_F_FRAG_LAST.
+ *
+ * Fragments of different messages are never interleaved within a pair of
+ * virtqueues (both sides serialize their fragmented sends per pair), but
+ * the RX path moves on to other pairs in the middle of a message, so a
+ * receiver keeps one reassembly buffer per endpoint and pair.
+ */
+#define RPMSG_F_FRAG		(1 << 0)
+#define RPMSG_F_FRAG_FIRST	(1 << 1)
+#define RPMSG_F_FRAG_LAST	(1 << 2)
 
 /*
  * Local addresses are dynamically allocated on-demand.
@@ -46,8 +65,80 @@ struct rpmsg_hdr {
 /* Reserve address 500 for rpmsg devices creation service */
 #define RPMSG_FACTORY_ADDR		(500)
 
-/* Reserve address 60 for the OMX connection service */
-#define RPMSG_OMX_ADDR		(60)
+static unsigned int rx_budget = 64;
+
+/* a budget of 0 would have the RX thread spin without handling anything */
+static int rpmsg_set_rx_budget(const char *val, const struct kernel_param *kp)
+{
+	unsigned int budget;
+
+	if (kstrtouint(val, 0, &budget) || !budget || budget > INT_MAX)
+		return -EINVAL;
+
+	*(unsigned int *) kp->arg = budget;
+	return 0;
+}
+
+static struct kernel_param_ops rpmsg_rx_budget_ops = {
+	.set = rpmsg_set_rx_budget,
+	.get = param_get_uint,
+};
+module_param_cb(rx_budget, &rpmsg_rx_budget_ops, &rx_budget,
+							S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rx_budget, "Max messages handled by the RX thread in a row");
+
+static unsigned int rx_busy_poll_us;
+module_param(rx_busy_poll_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rx_busy_poll_us,
+		"How long the RX thread polls for messages before sleeping (us)");
+
+/* upper bound of a single busy-polling pass of the RX thread, in us */
+#define RPMSG_RX_BUSY_POLL_MAX_US	1000
+
+static bool timestamp;
+module_param(timestamp, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timestamp, "Stamp outgoing messages with the time they're sent");
+
+/*
+ * Users may hold on to RX buffers (see rpmsg_hold_rx_buffer()), but if a
+ * few slow readers could hold all of them, every endpoint of the remote
+ * processor would stall. Past this share, users have to copy instead.
+ */
+static unsigned int rx_hold_pct = 50;
+module_param(rx_hold_pct, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rx_hold_pct, "Max share of RX buffers users may hold (%)");
+
+/*
+ * Unless the platform dedicates a pair of vqs to high priority messages,
+ * this many TX buffers of each pair are kept for them instead.
+ */
+static unsigned int prio_tx_bufs = 4;
+module_param(prio_tx_bufs, uint, S_IRUGO);
+MODULE_PARM_DESC(prio_tx_bufs, "TX buffers kept for high priority messages");
+
+/*
+ * Timestamps are carried in the (otherwise unused) 32-bit header field,
+ * so only the low bits of the monotonic time in ns are kept; differences
+ * are still right as long as messages are less than ~4s old. Zero means
+ * "not stamped".
+ */
+static u32 rpmsg_timestamp(void)
+{
+	u32 ts = (u32) ktime_to_ns(ktime_get());
+
+	return ts ? ts : 1;
+}
+
+static void rpmsg_free_ept(struct rcu_head *rcu)
+{
+	struct rpmsg_endpoint *ept = container_of(rcu, struct rpmsg_endpoint,
+									rcu);
+	int i;
+
+	for (i = 0; i < RPMSG_MAX_VQ_PAIRS; i++)
+		kfree(ept->frag[i].buf);
+	kfree(ept);
+}
 
 /* assign a new local address, and bind it to the user's callback function */
 struct rpmsg_endpoint *rpmsg_create_ept(struct rpmsg_channel *rpdev,
@@ -70,6 +161,7 @@ struct rpmsg_endpoint *rpmsg_create_ept(struct rpmsg_channel *rpdev,
 	ept->rpdev = rpdev;
 	ept->cb = cb;
 	ept->priv = priv;
+	init_completion(&ept->released);
 
 	request = addr == RPMSG_ADDR_ANY ? RP_MSG_RESERVED_ADDRESSES : addr;
 
@@ -89,12 +181,19 @@ struct rpmsg_endpoint *rpmsg_create_ept(struct rpmsg_channel *rpdev,
 
 	ept->addr = tmpaddr;
 
+	/* only now may the RX path start using it */
+	atomic_set(&ept->refcount, 1);
+
 	spin_unlock(&rp->endpoints_lock);
 
 	return ept;
 
 rem_idr:
-	idr_remove(&rp->endpoints, request);
+	idr_remove(&rp->endpoints, tmpaddr);
+	spin_unlock(&rp->endpoints_lock);
+	/* lockless lookups may have caught a glimpse of it */
+	call_rcu(&ept->rcu, rpmsg_free_ept);
+	return NULL;
 free_ept:
 	spin_unlock(&rp->endpoints_lock);
 	kfree(ept);
@@ -102,6 +201,18 @@ free_ept:
 }
 EXPORT_SYMBOL_GPL(rpmsg_create_ept);
 
+/* drop a reference to an endpoint */
+static void rpmsg_put_ept(struct rpmsg_endpoint *ept)
+{
+	if (atomic_dec_and_test(&ept->refcount))
+		complete(&ept->released);
+}
+
+/*
+ * Once this returns, the endpoint's callback is no longer running, and
+ * will not be invoked again. It must therefore not be called from the
+ * endpoint's own callback.
+ */
 void rpmsg_destroy_ept(struct rpmsg_endpoint *ept)
 {
 	struct rpmsg_rproc *rp = ept->rpdev->rp;
@@ -110,262 +221,1550 @@ void rpmsg_destroy_ept(struct rpmsg_endpoint *ept)
 	idr_remove(&rp->endpoints, ept->addr);
 	spin_unlock(&rp->endpoints_lock);
 
-	kfree(ept);
+	/* drop the owner's reference, and wait for in-flight callbacks */
+	if (!atomic_dec_and_test(&ept->refcount))
+		wait_for_completion(&ept->released);
+
+	/* lockless lookups may still be looking at it */
+	call_rcu(&ept->rcu, rpmsg_free_ept);
 }
 EXPORT_SYMBOL_GPL(rpmsg_destroy_ept);
 
-/* horrible buf "allocator" that is just enough for now */
-static void *get_a_buf(struct rpmsg_rproc *rp)
+/*
+ * Grab a free TX buffer. Must be called with svq_lock held.
+ *
+ * Free buffers are kept on a simple stack. Only when that stack runs dry
+ * do we look at the TX used ring, and then we reclaim every buffer the
+ * remote processor has consumed so far in one go.
+ *
+ * The last @tx_reserve buffers of the stack are only handed out for
+ * high priority messages.
+ */
+static void *get_a_buf(struct rpmsg_vq_pair *vqp, bool prio)
+{
+	int reserve = prio ? 0 : vqp->rp->tx_reserve;
+	void *buf;
+	int inflight;
+
+	if (vqp->tx_free <= reserve)
+		rpmsg_reclaim_bufs(vqp);
+
+	if (vqp->tx_free <= reserve)
+		return NULL;
+
+	buf = vqp->tx_pool[--vqp->tx_free];
+
+	inflight = vqp->rp->vq_tx_bufs - vqp->tx_free;
+	if (inflight > vqp->tx_inflight_hwm)
+		vqp->tx_inflight_hwm = inflight;
+
+	return buf;
+}
+
+/* return an unused TX buffer to the pool. Must be called with svq_lock held */
+static void put_a_buf(struct rpmsg_vq_pair *vqp, void *buf)
+{
+	vqp->tx_pool[vqp->tx_free++] = buf;
+}
+
+/* grab a free TX buffer, if there is one */
+static void *try_get_a_buf(struct rpmsg_vq_pair *vqp, bool prio)
+{
+	void *buf;
+
+	spin_lock(&vqp->svq_lock);
+	buf = get_a_buf(vqp, prio);
+	spin_unlock(&vqp->svq_lock);
+
+	return buf;
+}
+
+/*
+ * Pick the pair of virtqueues an endpoint sends its messages on. All the
+ * messages of a given source address go through the same pair, so they
+ * reach the remote processor in the order they were sent. The exception
+ * are high priority messages, which use the priority lane (if there is
+ * one) to overtake the others.
+ */
+static struct rpmsg_vq_pair *rpmsg_tx_vqp(struct rpmsg_rproc *rp, u32 src,
+								bool prio)
+{
+	if (!rp->prio_lane)
+		return &rp->vqp[src % rp->num_vq_pairs];
+
+	if (prio)
+		return &rp->vqp[0];
+
+	return &rp->vqp[1 + src % (rp->num_vq_pairs - 1)];
+}
+
+/* the pair of virtqueues a TX buffer belongs to */
+static struct rpmsg_vq_pair *rpmsg_tx_buf_vqp(struct rpmsg_rproc *rp,
+							struct rpmsg_hdr *msg)
+{
+	int idx = ((void *) msg - rp->sbufs) / rp->tx_buf_size;
+
+	return &rp->vqp[idx / rp->vq_tx_bufs];
+}
+
+/*
+ * Senders that are about to sleep waiting for a TX buffer need the remote
+ * processor to tell us when it consumes one, so "tx-complete" interrupts
+ * are enabled as long as there is at least one sleeper around.
+ */
+static void rpmsg_upref_sleepers(struct rpmsg_vq_pair *vqp)
+{
+	spin_lock(&vqp->svq_lock);
+	if (!vqp->sleepers++)
+		virtqueue_enable_cb(vqp->svq);
+	spin_unlock(&vqp->svq_lock);
+}
+
+static void rpmsg_downref_sleepers(struct rpmsg_vq_pair *vqp)
+{
+	spin_lock(&vqp->svq_lock);
+	if (!--vqp->sleepers && !vqp->tx_poll_armed)
+		virtqueue_disable_cb(vqp->svq);
+	spin_unlock(&vqp->svq_lock);
+}
+
+/* take back all the TX buffers consumed by the remote processor so far */
+static void rpmsg_reclaim_bufs(struct rpmsg_vq_pair *vqp)
 {
 	unsigned int len;
+	void *buf;
 
-	/* either pick the next unused buffer */
-	if (rp->last_sbuf < rp->num_bufs / 2)
-		return rp->sbufs + rp->buf_size * rp->last_sbuf++;
-	/* or recycle a used one */
-	else
-		return virtqueue_get_buf(rp->svq, &len);
+	while ((buf = virtqueue_get_buf(vqp->svq, &len)))
+		vqp->tx_pool[vqp->tx_free++] = buf;
 }
 
-int rpmsg_send_offchannel(struct rpmsg_channel *rpdev, u32 src, u32 dst,
-					void *data, int len)
+/* tell the remote processor it has pending messages to read */
+static void __rpmsg_kick_vqp(struct rpmsg_vq_pair *vqp)
 {
-	struct rpmsg_rproc *rp = rpdev->rp;
-	struct scatterlist sg;
-	struct rpmsg_hdr *msg;
-	int err;
-	unsigned long offset;
-	void *sim_addr;
+	trace_rpmsg_kick(vqp->rp->id, true);
+	virtqueue_kick(vqp->svq);
+	rpmsg_stat_inc(vqp->rp, tx_kicks);
+	vqp->tx_unkicked = false;
+}
 
-	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
-		dev_err(&rpdev->dev, "invalid address (src 0x%x, dst 0x%x)\n",
-				src, dst);
-		return -EINVAL;
-	}
+/* kick the remote processor about messages queued without a kick, if any */
+static void rpmsg_kick_vqp(struct rpmsg_vq_pair *vqp)
+{
+	spin_lock(&vqp->svq_lock);
+	if (vqp->tx_unkicked)
+		__rpmsg_kick_vqp(vqp);
+	spin_unlock(&vqp->svq_lock);
+}
 
-	/* payloads sizes are currently limited */
-	if (len > rp->buf_size - sizeof(struct rpmsg_hdr)) {
-		dev_err(&rpdev->dev, "message is too big (%d)\n", len);
-		return -EMSGSIZE;
-	}
+/*
+ * the endpoint at @src, if there is one, for its TX statistics. messages
+ * may also be sent off-channel from addresses no endpoint is bound to.
+ * must be called within an RCU read-side critical section
+ */
+static struct rpmsg_endpoint *rpmsg_tx_ept(struct rpmsg_rproc *rp, u32 src)
+{
+	return idr_find(&rp->endpoints, src);
+}
 
-	/* grab a buffer. todo: add blocking support in case no buf is free */
-	msg = get_a_buf(rp);
-	if (!msg)
-		return -ENOMEM;
+/*
+ * Grab a free TX buffer of @vqp for a message from @src, waiting up to
+ * @timeout jiffies for the remote processor to return one if all of them
+ * are in use.
+ */
+static struct rpmsg_hdr *rpmsg_get_a_buf(struct rpmsg_channel *rpdev,
+		struct rpmsg_vq_pair *vqp, u32 src, bool prio, long timeout)
+{
+	struct rpmsg_endpoint *ept;
+	struct rpmsg_hdr *msg;
+	long err;
 
-	msg->len = len;
-	msg->flags = 0;
-	msg->src = src;
-	msg->dst = dst;
-	msg->unused = 0;
-	memcpy(msg->data, data, len);
+	msg = try_get_a_buf(vqp, prio);
+	if (msg)
+		return msg;
 
-	pr_debug("From: 0x%x, To: 0x%x, Len: %d, Flags: %d, Unused: %d\n",
-					msg->src, msg->dst, msg->len,
-					msg->flags, msg->unused);
-	print_hex_dump(KERN_DEBUG, "rpmsg_virtio TX: ", DUMP_PREFIX_NONE, 16, 1,
-					msg, sizeof(*msg) + msg->len, true);
+	rpmsg_stat_inc(vqp->rp, tx_no_buf);
 
-	offset = ((unsigned long) msg) - ((unsigned long) rp->rbufs);
-	sim_addr = rp->sim_base + offset;
-	sg_init_one(&sg, sim_addr, sizeof(*msg) + len);
+	rcu_read_lock();
+	ept = rpmsg_tx_ept(vqp->rp, src);
+	if (ept)
+		atomic64_inc(&ept->tx_no_buf);
+	rcu_read_unlock();
 
-	/* protect svq from simultaneous concurrent manipulations */
-	spin_lock(&rp->svq_lock);
+	if (!timeout)
+		return ERR_PTR(-ENOMEM);
 
-	/* add message to the remote processor's virtqueue */
-	err = virtqueue_add_buf_gfp(rp->svq, &sg, 1, 0, msg, GFP_KERNEL);
-	if (err < 0) {
-		pr_err("failed to add a virtqueue buffer: %d\n", err);
-		goto out;
+	/* the remote can't return buffers it wasn't told about */
+	rpmsg_kick_vqp(vqp);
+
+	/* no free buffer ? wait for one to be returned by the remote */
+	rpmsg_upref_sleepers(vqp);
+	err = wait_event_interruptible_timeout(vqp->sendq,
+				(msg = try_get_a_buf(vqp, prio)), timeout);
+	rpmsg_downref_sleepers(vqp);
+
+	if (!msg) {
+		dev_dbg(&rpdev->dev, "no free TX buffer: %ld\n", err);
+		return ERR_PTR(err ? err : -ETIMEDOUT);
 	}
 
-	/* tell the remote processor it has a pending message to read */
-	virtqueue_kick(rp->svq);
+	return msg;
+}
 
-	err = 0;
-out:
-	spin_unlock(&rp->svq_lock);
-	return err;
+/*
+ * With cacheable buffers, a message must be written back before the remote
+ * processor gets to read it, and invalidated before we read what the remote
+ * processor wrote. Only the bytes that are actually in use are synced.
+ */
+static void rpmsg_clean_buf(struct rpmsg_rproc *rp, void *va, size_t len)
+{
+	if (rp->cache_ops)
+		rp->cache_ops->clean(rp->vdev, va, len);
 }
-EXPORT_SYMBOL_GPL(rpmsg_send_offchannel);
 
-int rpmsg_send(struct rpmsg_channel *rpdev, void *data, int len)
+static void rpmsg_inv_buf(struct rpmsg_rproc *rp, void *va, size_t len)
 {
-	return rpmsg_send_offchannel(rpdev, rpdev->src, rpdev->dst, data, len);
+	if (rp->cache_ops)
+		rp->cache_ops->inv(rp->vdev, va, len);
 }
-EXPORT_SYMBOL_GPL(rpmsg_send);
 
-int rpmsg_sendto(struct rpmsg_channel *rpdev, void *data, int len, u32 dst)
+/* translate the payload address of a TX buffer back to its rpmsg header */
+static struct rpmsg_hdr *rpmsg_tx_buf_to_hdr(struct rpmsg_rproc *rp,
+								void *data)
 {
-	return rpmsg_send_offchannel(rpdev, rpdev->src, dst, data, len);
+	struct rpmsg_hdr *msg = data - sizeof(*msg);
+	unsigned long offset = (void *) msg - rp->sbufs;
+
+	if ((void *) msg < rp->sbufs || offset % rp->tx_buf_size ||
+				offset >= rp->tx_buf_size * rp->num_tx_bufs)
+		return NULL;
+
+	return msg;
 }
-EXPORT_SYMBOL_GPL(rpmsg_sendto);
 
-static void rpmsg_recv_done(struct virtqueue *rvq)
+/* give back a TX buffer that was reserved but not sent */
+static void rpmsg_return_a_buf(struct rpmsg_rproc *rp, struct rpmsg_hdr *msg)
 {
-	struct rpmsg_hdr *msg;
-	unsigned int len;
+	struct rpmsg_vq_pair *vqp = rpmsg_tx_buf_vqp(rp, msg);
+
+	spin_lock(&vqp->svq_lock);
+	put_a_buf(vqp, msg);
+	spin_unlock(&vqp->svq_lock);
+
+	/* someone might be waiting for it */
+	wake_up_interruptible(&vqp->sendq);
+}
+
+/*
+ * fill in the header of a TX buffer, and hand it over to the remote.
+ * the remote is kicked only if @kick is set.
+ */
+static int rpmsg_send_buf(struct rpmsg_channel *rpdev, struct rpmsg_hdr *msg,
+				u32 src, u32 dst, int len, u16 flags, bool kick)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	struct rpmsg_vq_pair *vqp = rpmsg_tx_buf_vqp(rp, msg);
 	struct rpmsg_endpoint *ept;
 	struct scatterlist sg;
+	int err;
 	unsigned long offset;
 	void *sim_addr;
-	struct rpmsg_rproc *rp = rvq->vdev->priv;
-	int err;
 
-	msg = virtqueue_get_buf(rvq, &len);
-	if (!msg) {
-		pr_err("uhm, incoming signal, but no used buffer ?\n");
-		return;
-	}
+	msg->len = len;
+	msg->flags = flags;
+	msg->src = src;
+	msg->dst = dst;
+	msg->unused = timestamp ? rpmsg_timestamp() : 0;
 
 	pr_debug("From: 0x%x, To: 0x%x, Len: %d, Flags: %d, Unused: %d\n",
 					msg->src, msg->dst, msg->len,
 					msg->flags, msg->unused);
-	print_hex_dump(KERN_DEBUG, "rpmsg_virtio RX: ", DUMP_PREFIX_NONE, 16, 1,
+	print_hex_dump(KERN_DEBUG, "rpmsg_virtio TX: ", DUMP_PREFIX_NONE, 16, 1,
 					msg, sizeof(*msg) + msg->len, true);
 
-	/* fetch the callback of the appropriate user */
-	spin_lock(&rp->endpoints_lock);
-	ept = idr_find(&rp->endpoints, msg->dst);
-	spin_unlock(&rp->endpoints_lock);
-
-	if (ept && ept->cb)
-		ept->cb(ept->rpdev, msg->data, msg->len, ept->priv, msg->src);
-	else
-		pr_warn("msg received with no recepient\n");
-
-	/* add the buffer back to the remote processor's virtqueue */
 	offset = ((unsigned long) msg) - ((unsigned long) rp->rbufs);
 	sim_addr = rp->sim_base + offset;
 	sg_init_one(&sg, sim_addr, sizeof(*msg) + len);
 
-	err = virtqueue_add_buf_gfp(rp->rvq, &sg, 0, 1, msg, GFP_KERNEL);
+	rpmsg_clean_buf(rp, msg, sizeof(*msg) + len);
+
+	/* protect svq from simultaneous concurrent manipulations */
+	spin_lock(&vqp->svq_lock);
+
+	/* add message to the remote processor's virtqueue */
+	err = virtqueue_add_buf_gfp(vqp->svq, &sg, 1, 0, msg, GFP_ATOMIC);
 	if (err < 0) {
 		pr_err("failed to add a virtqueue buffer: %d\n", err);
-		return;
+		spin_unlock(&vqp->svq_lock);
+		rpmsg_return_a_buf(rp, msg);
+		return err;
 	}
 
-	/* tell the remote processor we added another available rx buffer */
-	virtqueue_kick(rp->rvq);
-}
+	rpmsg_stat_inc(rp, tx_msgs);
+	rpmsg_stat_add(rp, tx_bytes, len);
 
-static void rpmsg_xmit_done(struct virtqueue *svq)
-{
-	pr_warn("BIOS did not obey virtqueue_disable_cb(rp->svq)\n");
-}
+	rcu_read_lock();
+	ept = rpmsg_tx_ept(rp, src);
+	if (ept) {
+		atomic64_inc(&ept->tx_msgs);
+		atomic64_add(len, &ept->tx_bytes);
+	}
+	rcu_read_unlock();
 
-static int rpmsg_probe(struct virtio_device *vdev)
-{
-	vq_callback_t *callbacks[] = { rpmsg_recv_done, rpmsg_xmit_done };
-	const char *names[] = { "input", "output" };
-	struct virtqueue *vqs[2];
-	struct rpmsg_rproc *rp;
-	void *addr;
-	int err, i, id, num_bufs, buf_size, total_buf_size;
+	trace_rpmsg_send(rp->id, src, dst, len, flags, msg->unused);
 
-	rp = kzalloc(sizeof(*rp), GFP_KERNEL);
-	if (!rp)
-		return -ENOMEM;
+	/* tell the remote processor it has a pending message to read */
+	if (kick)
+		__rpmsg_kick_vqp(vqp);
+	else
+		vqp->tx_unkicked = true;
 
-	rp->vdev = vdev;
+	spin_unlock(&vqp->svq_lock);
+	return 0;
+}
 
-	idr_init(&rp->endpoints);
-	spin_lock_init(&rp->endpoints_lock);
-	spin_lock_init(&rp->svq_lock);
+/* gather the next @len bytes of an iovec into @to, advancing its cursor */
+static void rpmsg_iov_gather(void *to, const struct kvec **iov, size_t *off,
+								int len)
+{
+	while (len) {
+		int n = min_t(size_t, len, (*iov)->iov_len - *off);
+
+		memcpy(to, (*iov)->iov_base + *off, n);
+		to += n;
+		len -= n;
+		*off += n;
+
+		if (*off == (*iov)->iov_len) {
+			(*iov)++;
+			*off = 0;
+		}
+	}
+}
 
-	/* We expect two virtqueues, receive then send */
-	err = vdev->config->find_vqs(vdev, 2, vqs, callbacks, names);
-	if (err)
-		goto free_vi;
+/**
+ * rpmsg_sendv_offchannel() - send a message gathered from several buffers
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @iov: the buffers making up the payload
+ * @iovcnt: number of entries in @iov
+ * @timeout: how long to wait for each free TX buffer, see
+ *	     rpmsg_send_offchannel_raw()
+ *
+ * The payload may be up to RPMSG_MAX_MSG_SIZE bytes long. If it doesn't
+ * fit in a single TX buffer, it is transparently split into fragments,
+ * which are reassembled by the receiving side before its endpoint callback
+ * is invoked. All the TX buffers a message needs are reserved before any
+ * of them is sent, so on failure nothing has been sent at all.
+ *
+ * Since fragmented sends are serialized on a mutex, this may sleep even
+ * when @timeout is 0, unless the payload fits in a single buffer.
+ */
+int rpmsg_sendv_offchannel(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+			const struct kvec *iov, int iovcnt, long timeout)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	int payload = rp->tx_buf_size - sizeof(struct rpmsg_hdr);
+	struct rpmsg_vq_pair *vqp;
+	struct rpmsg_hdr *msg, **frags;
+	size_t off = 0;
+	int i, nfrags, len = 0, err = 0;
 
-	rp->rvq = vqs[0];
-	rp->svq = vqs[1];
+	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
+		dev_err(&rpdev->dev, "invalid address (src 0x%x, dst 0x%x)\n",
+				src, dst);
+		return -EINVAL;
+	}
 
-	/* Platform must supply the id of this remote processor device.
-	 * consider changing this to an optional virtio feature */
-	vdev->config->get(vdev, VIRTIO_IPC_PROC_ID, &id, sizeof(id));
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 
-	rp->id = id;
+	if (len > RPMSG_MAX_MSG_SIZE) {
+		dev_err(&rpdev->dev, "message is too big (%d)\n", len);
+		return -EMSGSIZE;
+	}
 
-	/* Platform must supply pre-allocated uncached buffers for now */
-	vdev->config->get(vdev, VIRTIO_IPC_BUF_ADDR, &addr, sizeof(addr));
-	vdev->config->get(vdev, VIRTIO_IPC_BUF_NUM, &num_bufs,
-							sizeof(num_bufs));
-	vdev->config->get(vdev, VIRTIO_IPC_BUF_SZ, &buf_size, sizeof(buf_size));
+	vqp = rpmsg_tx_vqp(rp, src, false);
 
-	total_buf_size = num_bufs * buf_size;
+	/* the common case: a single buffer will do */
+	if (len <= payload) {
+		msg = rpmsg_get_a_buf(rpdev, vqp, src, false, timeout);
+		if (IS_ERR(msg))
+			return PTR_ERR(msg);
 
-	dev_dbg(&vdev->dev, "%d buffers, size %d, addr 0x%x, total 0x%x\n",
-		num_bufs, buf_size, (unsigned int) addr, total_buf_size);
+		rpmsg_iov_gather(msg->data, &iov, &off, len);
 
-	rp->num_bufs = num_bufs;
-	rp->buf_size = buf_size;
-	rp->rbufs = addr;
-	rp->sbufs = addr + total_buf_size / 2;
+		return rpmsg_send_buf(rpdev, msg, src, dst, len, 0, true);
+	}
 
-	/* simulated addr base to make virt_to_page happy. consider using
-	 * virtio features for that */
-	vdev->config->get(vdev, VIRTIO_IPC_SIM_BASE, &rp->sim_base,
-							sizeof(rp->sim_base));
+	/* we'd wait forever for buffers we don't have */
+	nfrags = DIV_ROUND_UP(len, payload);
+	if (nfrags > rp->vq_tx_bufs - rp->tx_reserve) {
+		dev_err(&rpdev->dev, "message is too big (%d)\n", len);
+		return -EMSGSIZE;
+	}
 
-	/* set up the receive buffers */
-	/* note: those RP_MSG_* macros should be retrieved from the platform
-	 * and not compiled into the driver... */
-	for (i = 0; i < num_bufs/2; i++) {
-		struct scatterlist sg;
-		void *tmpaddr = rp->rbufs + i * buf_size;
-		void *simaddr = rp->sim_base + i * buf_size;
+	frags = kmalloc(nfrags * sizeof(*frags), GFP_KERNEL);
+	if (!frags)
+		return -ENOMEM;
 
-		sg_init_one(&sg, simaddr, buf_size);
-		err = virtqueue_add_buf_gfp(rp->rvq, &sg, 0, 1, tmpaddr,
-								GFP_KERNEL);
-		WARN_ON(err < 0); /* sanity check; this can't happen */
+	/*
+	 * only one fragmented message is built at a time: this keeps its
+	 * fragments contiguous on the wire, and prevents concurrent senders
+	 * from each holding a part of the TX buffers they need.
+	 */
+	mutex_lock(&vqp->frag_lock);
+
+	for (i = 0; i < nfrags; i++) {
+		frags[i] = rpmsg_get_a_buf(rpdev, vqp, src, false, timeout);
+		if (IS_ERR(frags[i])) {
+			err = PTR_ERR(frags[i]);
+			while (i--)
+				rpmsg_return_a_buf(rp, frags[i]);
+			goto unlock;
+		}
 	}
 
-	/* tell the remote processor it can start sending data */
-	virtqueue_kick(rp->rvq);
-
-	/* suppress "tx-complete" interrupts */
-	virtqueue_disable_cb(rp->svq);
+	for (i = 0; i < nfrags; i++) {
+		int chunk = min(len, payload);
+		u16 flags = RPMSG_F_FRAG;
 
-	vdev->priv = rp;
+		if (i == 0)
+			flags |= RPMSG_F_FRAG_FIRST;
+		if (i == nfrags - 1)
+			flags |= RPMSG_F_FRAG_LAST;
 
-	dev_info(&vdev->dev, "rpmsg backend dev %d probed successfully\n", id);
+		rpmsg_iov_gather(frags[i]->data, &iov, &off, chunk);
+		len -= chunk;
 
-	/* manual hack: create rpmsg devices */
-	if (id == 0) {
-		rp->rpcli = rpmsg_create_channel(rp, "rpmsg-client-sample", RPMSG_ADDR_ANY, 50);
-		rp->rpser = rpmsg_create_channel(rp, "rpmsg-server-sample", 137, RPMSG_ADDR_ANY);
-		rp->rpomx = rpmsg_create_channel(rp, "rpmsg-omx", RPMSG_ADDR_ANY, RPMSG_OMX_ADDR);
-	} else if (id == 1) {
-		rp->rpcli = rpmsg_create_channel(rp, "rpmsg-client-sample", RPMSG_ADDR_ANY, 51);
+		/* kick the remote only once, when the whole message is in */
+		err = rpmsg_send_buf(rpdev, frags[i], src, dst, chunk, flags,
+							i == nfrags - 1);
+		if (err)
+			break;
 	}
 
-	return 0;
+	if (err) {
+		/* rpmsg_send_buf() already took care of frags[i] */
+		while (++i < nfrags)
+			rpmsg_return_a_buf(rp, frags[i]);
+
+		/* flush what was already queued; the remote will drop it */
+		spin_lock(&vqp->svq_lock);
+		trace_rpmsg_kick(rp->id, true);
+		virtqueue_kick(vqp->svq);
+		rpmsg_stat_inc(rp, tx_kicks);
+		spin_unlock(&vqp->svq_lock);
+	}
 
-free_vi:
-	kfree(rp);
+unlock:
+	mutex_unlock(&vqp->frag_lock);
+	kfree(frags);
 	return err;
 }
-
-static void __devexit rpmsg_remove(struct virtio_device *vdev)
+EXPORT_SYMBOL_GPL(rpmsg_sendv_offchannel);
+
+/**
+ * rpmsg_send_offchannel_raw() - send a message, waiting for a TX buffer
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @data: payload of the message
+ * @len: length of the payload
+ * @timeout: how long (in jiffies) to wait for a free TX buffer, if none is
+ *	     available right now. 0 means don't wait at all, and
+ *	     MAX_SCHEDULE_TIMEOUT means wait as long as it takes.
+ *
+ * Returns 0 on success, -ENOMEM if no TX buffer is available and @timeout
+ * is 0, -ETIMEDOUT if @timeout elapsed before a TX buffer was returned by
+ * the remote processor, or -ERESTARTSYS if the wait was interrupted.
+ */
+int rpmsg_send_offchannel_raw(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+					void *data, int len, long timeout)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	struct rpmsg_hdr *msg;
+
+	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
+		dev_err(&rpdev->dev, "invalid address (src 0x%x, dst 0x%x)\n",
+				src, dst);
+		return -EINVAL;
+	}
+
+	/* larger payloads need to be fragmented */
+	if (len > rp->tx_buf_size - sizeof(struct rpmsg_hdr)) {
+		struct kvec iov = { .iov_base = data, .iov_len = len };
+
+		return rpmsg_sendv_offchannel(rpdev, src, dst, &iov, 1, timeout);
+	}
+
+	msg = rpmsg_get_a_buf(rpdev, rpmsg_tx_vqp(rp, src, false), src, false,
+								timeout);
+	if (IS_ERR(msg))
+		return PTR_ERR(msg);
+
+	/* the buffer is ours now, so fill it in without holding the lock */
+	memcpy(msg->data, data, len);
+
+	return rpmsg_send_buf(rpdev, msg, src, dst, len, 0, true);
+}
+EXPORT_SYMBOL_GPL(rpmsg_send_offchannel_raw);
+
+/**
+ * rpmsg_send_offchannel_prio() - send a high priority message
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @data: payload of the message
+ * @len: length of the payload, which must fit in a single TX buffer
+ * @timeout: how long to wait for a free TX buffer, see
+ *	     rpmsg_send_offchannel_raw()
+ *
+ * Meant for latency-sensitive control messages, which shouldn't wait
+ * behind bulk traffic. If the platform provides a priority lane, the
+ * message goes through it, and so may overtake messages that were sent
+ * earlier. Otherwise, it can at least use the TX buffers that are
+ * reserved for high priority messages.
+ *
+ * Returns 0 on success, -EMSGSIZE if the message doesn't fit in a buffer,
+ * or any of the errors of rpmsg_send_offchannel_raw().
+ */
+int rpmsg_send_offchannel_prio(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+					void *data, int len, long timeout)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	struct rpmsg_hdr *msg;
+
+	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
+		dev_err(&rpdev->dev, "invalid address (src 0x%x, dst 0x%x)\n",
+				src, dst);
+		return -EINVAL;
+	}
+
+	if (len > rp->tx_buf_size - sizeof(struct rpmsg_hdr)) {
+		dev_err(&rpdev->dev, "message is too big (%d)\n", len);
+		return -EMSGSIZE;
+	}
+
+	msg = rpmsg_get_a_buf(rpdev, rpmsg_tx_vqp(rp, src, true), src, true,
+								timeout);
+	if (IS_ERR(msg))
+		return PTR_ERR(msg);
+
+	memcpy(msg->data, data, len);
+
+	return rpmsg_send_buf(rpdev, msg, src, dst, len, 0, true);
+}
+EXPORT_SYMBOL_GPL(rpmsg_send_offchannel_prio);
+
+/**
+ * rpmsg_get_max_payload() - payload size of a single TX buffer
+ * @rpdev: the rpmsg channel
+ *
+ * This is the largest message that can be sent without fragmenting it,
+ * e.g. with rpmsg_send_offchannel_prio().
+ */
+int rpmsg_get_max_payload(struct rpmsg_channel *rpdev)
+{
+	return rpdev->rp->tx_buf_size - sizeof(struct rpmsg_hdr);
+}
+EXPORT_SYMBOL_GPL(rpmsg_get_max_payload);
+
+/**
+ * rpmsg_get_tx_buffer() - reserve a TX buffer to build a message in place
+ * @rpdev: the rpmsg channel
+ * @src: source address the message is going to be sent from
+ * @len: returns the maximum payload size the buffer can take
+ * @timeout: how long to wait for a free TX buffer, see
+ *	     rpmsg_send_offchannel_raw()
+ *
+ * Returns a pointer to the payload area of a shared-memory TX buffer, or an
+ * ERR_PTR() on failure. The caller can build its message directly in there,
+ * and must then either send it using rpmsg_send_offchannel_nocopy(), or
+ * give it back using rpmsg_put_tx_buffer().
+ *
+ * The buffer is taken from the virtqueue pair @src sends on, so the message
+ * stays in order with everything else @src sends.
+ */
+void *rpmsg_get_tx_buffer(struct rpmsg_channel *rpdev, u32 src, int *len,
+								long timeout)
+{
+	struct rpmsg_vq_pair *vqp = rpmsg_tx_vqp(rpdev->rp, src, false);
+	struct rpmsg_hdr *msg;
+
+	msg = rpmsg_get_a_buf(rpdev, vqp, src, false, timeout);
+	if (IS_ERR(msg))
+		return msg;
+
+	*len = rpdev->rp->tx_buf_size - sizeof(*msg);
+
+	return msg->data;
+}
+EXPORT_SYMBOL_GPL(rpmsg_get_tx_buffer);
+
+/**
+ * rpmsg_put_tx_buffer() - give back an unused TX buffer
+ * @rpdev: the rpmsg channel
+ * @data: a buffer returned by rpmsg_get_tx_buffer()
+ */
+void rpmsg_put_tx_buffer(struct rpmsg_channel *rpdev, void *data)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	struct rpmsg_hdr *msg = rpmsg_tx_buf_to_hdr(rp, data);
+
+	if (WARN_ON(!msg))
+		return;
+
+	rpmsg_return_a_buf(rp, msg);
+}
+EXPORT_SYMBOL_GPL(rpmsg_put_tx_buffer);
+
+/* send (or only queue, if !@kick) a message built in a TX buffer */
+static int rpmsg_nocopy(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+						void *data, int len, bool kick)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	struct rpmsg_hdr *msg = rpmsg_tx_buf_to_hdr(rp, data);
+
+	if (WARN_ON(!msg))
+		return -EINVAL;
+
+	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY ||
+				len > rp->tx_buf_size - sizeof(*msg)) {
+		dev_err(&rpdev->dev, "bad msg (src 0x%x, dst 0x%x, len %d)\n",
+				src, dst, len);
+		rpmsg_put_tx_buffer(rpdev, data);
+		return -EINVAL;
+	}
+
+	return rpmsg_send_buf(rpdev, msg, src, dst, len, 0, kick);
+}
+
+/**
+ * rpmsg_send_offchannel_nocopy() - send a message built in a TX buffer
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @data: a buffer returned by rpmsg_get_tx_buffer(), holding the payload
+ * @len: length of the payload
+ *
+ * Fills in the rpmsg header and hands the buffer over to the remote
+ * processor, without copying the payload. The buffer belongs to rpmsg
+ * again once this returns, even on failure.
+ */
+int rpmsg_send_offchannel_nocopy(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+							void *data, int len)
+{
+	return rpmsg_nocopy(rpdev, src, dst, data, len, true);
+}
+EXPORT_SYMBOL_GPL(rpmsg_send_offchannel_nocopy);
+
+/**
+ * rpmsg_queue_offchannel_nocopy() - queue a message built in a TX buffer
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @data: a buffer returned by rpmsg_get_tx_buffer(), holding the payload
+ * @len: length of the payload
+ *
+ * Like rpmsg_send_offchannel_nocopy(), except that the remote processor
+ * isn't kicked: the caller is expected to queue a burst of messages, and
+ * then call rpmsg_kick() once. Kicks are what the remote processor pays
+ * for (e.g. a mailbox interrupt each), so this is much cheaper than
+ * sending the messages one by one.
+ *
+ * Messages sent by anyone else on the same virtqueue, or a sender that has
+ * to wait for a TX buffer, kick the remote processor about the queued
+ * messages as well.
+ */
+int rpmsg_queue_offchannel_nocopy(struct rpmsg_channel *rpdev, u32 src,
+						u32 dst, void *data, int len)
+{
+	return rpmsg_nocopy(rpdev, src, dst, data, len, false);
+}
+EXPORT_SYMBOL_GPL(rpmsg_queue_offchannel_nocopy);
+
+/**
+ * rpmsg_kick() - tell the remote processor about queued messages
+ * @rpdev: the rpmsg channel
+ *
+ * Kicks the remote processor about the messages that were queued with
+ * rpmsg_queue_offchannel_nocopy(), on every virtqueue that has some.
+ */
+void rpmsg_kick(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	int i;
+
+	for (i = 0; i < rp->num_vq_pairs; i++)
+		rpmsg_kick_vqp(&rp->vqp[i]);
+}
+EXPORT_SYMBOL_GPL(rpmsg_kick);
+
+/**
+ * rpmsg_poll_tx() - poll for free TX buffers
+ * @rpdev: the rpmsg channel
+ * @src: source address the caller sends from
+ * @filp: the file being polled
+ * @wait: the poll table
+ * @wanted: how many free TX buffers it takes for the caller to be writable
+ *
+ * Lets rpmsg users report POLLOUT only when they can actually send without
+ * blocking. Returns true if at least @wanted TX buffers (of the virtqueue
+ * pair @src sends on) are free. Otherwise, "tx-complete" interrupts
+ * are armed, so the poller is woken up as soon as the remote processor
+ * gives some back.
+ *
+ * @wanted is capped at the number of buffers normal priority messages may
+ * use.
+ */
+bool rpmsg_poll_tx(struct rpmsg_channel *rpdev, u32 src, struct file *filp,
+			struct poll_table_struct *wait, int wanted)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	struct rpmsg_vq_pair *vqp = rpmsg_tx_vqp(rp, src, false);
+	int usable = rp->vq_tx_bufs - rp->tx_reserve;
+	bool ready;
+
+	wanted = clamp(wanted, 1, usable);
+
+	poll_wait(filp, &vqp->sendq, wait);
+
+	spin_lock(&vqp->svq_lock);
+
+	if (vqp->tx_free - rp->tx_reserve < wanted)
+		rpmsg_reclaim_bufs(vqp);
+
+	ready = vqp->tx_free - rp->tx_reserve >= wanted;
+
+	if (!ready) {
+		vqp->tx_poll_armed = true;
+		/* buffers might have been consumed in the meantime */
+		if (!virtqueue_enable_cb(vqp->svq)) {
+			rpmsg_reclaim_bufs(vqp);
+			ready = vqp->tx_free - rp->tx_reserve >= wanted;
+		}
+	} else if (vqp->tx_poll_armed) {
+		/* no need for interrupts anymore, unless senders sleep */
+		vqp->tx_poll_armed = false;
+		if (!vqp->sleepers)
+			virtqueue_disable_cb(vqp->svq);
+	}
+
+	spin_unlock(&vqp->svq_lock);
+
+	return ready;
+}
+EXPORT_SYMBOL_GPL(rpmsg_poll_tx);
+
+/* translate the payload address of an RX buffer to the buffer's index */
+static int rpmsg_rx_buf_index(struct rpmsg_rproc *rp, void *data)
+{
+	struct rpmsg_hdr *msg = data - sizeof(*msg);
+	unsigned long offset = (void *) msg - rp->rbufs;
+
+	if ((void *) msg < rp->rbufs || offset % rp->rx_buf_size ||
+				offset >= rp->rx_buf_size * rp->num_rx_bufs)
+		return -EINVAL;
+
+	return offset / rp->rx_buf_size;
+}
+
+/*
+ * add an RX buffer back to the remote processor's virtqueue, and, unless
+ * the caller is going to do that itself later, kick the remote processor.
+ */
+static void rpmsg_recycle_rx_buf(struct rpmsg_rproc *rp, struct rpmsg_hdr *msg,
+								bool kick)
+{
+	struct rpmsg_vq_pair *vqp;
+	struct scatterlist sg;
+	unsigned long offset, flags;
+	void *sim_addr;
+	int err;
+
+	offset = ((unsigned long) msg) - ((unsigned long) rp->rbufs);
+	sim_addr = rp->sim_base + offset;
+	sg_init_one(&sg, sim_addr, rp->rx_buf_size);
+
+	/* the buffer goes back to the pair it came from */
+	vqp = &rp->vqp[offset / rp->rx_buf_size / rp->vq_rx_bufs];
+
+	/* held buffers may be released from any context, even hardirq */
+	spin_lock_irqsave(&vqp->rvq_lock, flags);
+
+	err = virtqueue_add_buf_gfp(vqp->rvq, &sg, 0, 1, msg, GFP_ATOMIC);
+	if (err < 0) {
+		pr_err("failed to add a virtqueue buffer: %d\n", err);
+		goto out;
+	}
+
+	/* tell the remote processor we added another available rx buffer */
+	if (kick) {
+		trace_rpmsg_kick(rp->id, false);
+		virtqueue_kick(vqp->rvq);
+		rpmsg_stat_inc(rp, rx_kicks);
+	}
+
+out:
+	spin_unlock_irqrestore(&vqp->rvq_lock, flags);
+}
+
+/**
+ * rpmsg_hold_rx_buffer() - keep an RX buffer after the callback returns
+ * @rpdev: the rpmsg channel
+ * @data: the payload pointer the endpoint callback was invoked with
+ *
+ * By default, an RX buffer is given back to the remote processor as soon
+ * as the endpoint callback returns, so callbacks that want to keep the
+ * payload around have to copy it. Instead, a callback can call this to
+ * take ownership of the buffer, and hand it back later (from any context)
+ * using rpmsg_release_rx_buffer().
+ *
+ * Only a share of the RX buffers (see the rx_hold_pct parameter) may be
+ * held at any time, so that the remote processor can always send.
+ *
+ * This may only be called from within the endpoint callback. Returns 0 on
+ * success, -EINVAL if @data is not an RX buffer that can be held, or
+ * -EBUSY if too many RX buffers are held already; in both cases the
+ * payload must be copied as usual.
+ */
+int rpmsg_hold_rx_buffer(struct rpmsg_channel *rpdev, void *data)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	int idx = rpmsg_rx_buf_index(rp, data);
+	unsigned int max = rp->num_rx_bufs * min(rx_hold_pct, 100U) / 100;
+
+	if (idx < 0)
+		return idx;
+
+	/* the RX path must still own this buffer, i.e. we're in the cb */
+	if (WARN_ON(!atomic_inc_not_zero(&rp->rx_refs[idx])))
+		return -EINVAL;
+
+	if (atomic_inc_return(&rp->rx_held) > max) {
+		atomic_dec(&rp->rx_held);
+		/* the RX path still owns a reference, so this isn't the last */
+		atomic_dec(&rp->rx_refs[idx]);
+		return -EBUSY;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(rpmsg_hold_rx_buffer);
+
+/*
+ * drop a reference to an RX buffer, and recycle it if it was the last one.
+ * returns true if the buffer was recycled.
+ */
+static bool rpmsg_put_rx_buf(struct rpmsg_rproc *rp, int idx, bool kick)
+{
+	if (!atomic_dec_and_test(&rp->rx_refs[idx]))
+		return false;
+
+	rpmsg_recycle_rx_buf(rp, rp->rbufs + idx * rp->rx_buf_size, kick);
+	return true;
+}
+
+/**
+ * rpmsg_release_rx_buffer() - give back an RX buffer that was held
+ * @rpdev: the rpmsg channel
+ * @data: the payload pointer that was passed to rpmsg_hold_rx_buffer()
+ */
+void rpmsg_release_rx_buffer(struct rpmsg_channel *rpdev, void *data)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	int idx = rpmsg_rx_buf_index(rp, data);
+
+	if (WARN_ON(idx < 0))
+		return;
+
+	atomic_dec(&rp->rx_held);
+	rpmsg_put_rx_buf(rp, idx, true);
+}
+EXPORT_SYMBOL_GPL(rpmsg_release_rx_buffer);
+
+static void rpmsg_drop_frags(struct rpmsg_frag_state *frag)
+{
+	kfree(frag->buf);
+	frag->buf = NULL;
+	frag->len = 0;
+}
+
+/*
+ * Append a fragment to the reassembly buffer its endpoint keeps for the
+ * pair it arrived on. Only the RX path ever touches the reassembly state,
+ * and one context at a time, so no locking is needed. Returns true once
+ * the last fragment is in, at which point the whole message is available
+ * in @frag->buf.
+ */
+static bool rpmsg_recv_frag(struct rpmsg_rproc *rp,
+			struct rpmsg_frag_state *frag, struct rpmsg_hdr *msg)
+{
+	if (msg->flags & RPMSG_F_FRAG_FIRST) {
+		if (frag->buf) {
+			pr_warn("incomplete msg from 0x%x dropped\n",
+							frag->src);
+			rpmsg_stat_inc(rp, rx_dropped);
+			frag->len = 0;
+		} else {
+			frag->buf = kmalloc(RPMSG_MAX_MSG_SIZE, GFP_KERNEL);
+			if (!frag->buf) {
+				pr_err("no memory to reassemble msg\n");
+				return false;
+			}
+		}
+		frag->src = msg->src;
+	}
+
+	if (!frag->buf || frag->src != msg->src ||
+			msg->len > rp->rx_buf_size - sizeof(*msg) ||
+			frag->len + msg->len > RPMSG_MAX_MSG_SIZE) {
+		pr_warn("unexpected fragment from 0x%x dropped\n", msg->src);
+		rpmsg_stat_inc(rp, rx_dropped);
+		rpmsg_drop_frags(frag);
+		return false;
+	}
+
+	memcpy(frag->buf + frag->len, msg->data, msg->len);
+	frag->len += msg->len;
+
+	return msg->flags & RPMSG_F_FRAG_LAST;
+}
+
+/* invoke the endpoint's callback, and account for the time it took */
+static void rpmsg_ept_deliver(struct rpmsg_endpoint *ept, void *data, int len,
+								u32 src)
+{
+	u64 start, delta;
+
+	trace_rpmsg_cb_entry(ept->addr, src, len);
+
+	start = local_clock();
+	ept->cb(ept->rpdev, data, len, ept->priv, src);
+	delta = local_clock() - start;
+
+	trace_rpmsg_cb_exit(ept->addr, delta);
+
+	ept->rx_msgs++;
+	ept->rx_bytes += len;
+	ept->cb_ns_total += delta;
+	if (delta > ept->cb_ns_max)
+		ept->cb_ns_max = delta;
+}
+
+/*
+ * dispatch a single inbound message, which arrived on @vqp, to its
+ * endpoint. returns true if the buffer was added back to the RX virtqueue
+ * (without kicking the remote).
+ */
+static bool rpmsg_recv_single(struct rpmsg_vq_pair *vqp, struct rpmsg_hdr *msg)
+{
+	struct rpmsg_rproc *rp = vqp->rp;
+	struct rpmsg_frag_state *frag;
+	struct rpmsg_endpoint *ept;
+	u32 age = 0;
+	int idx;
+
+	pr_debug("From: 0x%x, To: 0x%x, Len: %d, Flags: %d, Unused: %d\n",
+					msg->src, msg->dst, msg->len,
+					msg->flags, msg->unused);
+	print_hex_dump(KERN_DEBUG, "rpmsg_virtio RX: ", DUMP_PREFIX_NONE, 16, 1,
+					msg, sizeof(*msg) + msg->len, true);
+
+	if (timestamp && msg->unused)
+		age = rpmsg_timestamp() - msg->unused;
+
+	trace_rpmsg_recv(rp->id, msg->src, msg->dst, msg->len, msg->flags,
+							msg->unused, age);
+
+	rpmsg_stat_inc(rp, rx_msgs);
+	rpmsg_stat_add(rp, rx_bytes, msg->len);
+
+	/* the RX path owns the buffer while the callback runs */
+	idx = rpmsg_rx_buf_index(rp, msg->data);
+	atomic_set(&rp->rx_refs[idx], 1);
+
+	/*
+	 * fetch the callback of the appropriate user, and make sure the
+	 * endpoint doesn't go away while its callback runs
+	 */
+	rcu_read_lock();
+	ept = idr_find(&rp->endpoints, msg->dst);
+	if (ept && !atomic_inc_not_zero(&ept->refcount))
+		ept = NULL;
+	rcu_read_unlock();
+
+	if (!ept || !ept->cb) {
+		pr_warn("msg received with no recepient\n");
+		rpmsg_stat_inc(rp, rx_dropped);
+	} else if (!(msg->flags & RPMSG_F_FRAG)) {
+		rpmsg_ept_deliver(ept, msg->data, msg->len, msg->src);
+	} else {
+		frag = &ept->frag[vqp - rp->vqp];
+		if (rpmsg_recv_frag(rp, frag, msg)) {
+			/* a reassembled message can't be held, users copy it */
+			rpmsg_ept_deliver(ept, frag->buf, frag->len, frag->src);
+			rpmsg_drop_frags(frag);
+		}
+	}
+
+	if (ept)
+		rpmsg_put_ept(ept);
+
+	/* unless the callback held on to it, give the buffer back */
+	return rpmsg_put_rx_buf(rp, idx, false);
+}
+
+static struct rpmsg_hdr *rpmsg_get_rx_buf(struct rpmsg_vq_pair *vqp)
+{
+	struct rpmsg_rproc *rp = vqp->rp;
+	struct rpmsg_hdr *msg;
+	unsigned long flags;
+	unsigned int len;
+
+	spin_lock_irqsave(&vqp->rvq_lock, flags);
+	msg = virtqueue_get_buf(vqp->rvq, &len);
+	spin_unlock_irqrestore(&vqp->rvq_lock, flags);
+
+	/* the header tells us how much of the payload needs invalidating */
+	if (msg && rp->cache_ops) {
+		rpmsg_inv_buf(rp, msg, sizeof(*msg));
+		rpmsg_inv_buf(rp, msg->data, min_t(size_t, msg->len,
+						rp->rx_buf_size - sizeof(*msg)));
+	}
+
+	return msg;
+}
+
+/*
+ * re-enable the RX interrupts of all the pairs. returns false if messages
+ * arrived in the meantime, in which case the caller should poll again.
+ */
+static bool rpmsg_enable_rx_cb(struct rpmsg_rproc *rp)
+{
+	unsigned long flags;
+	bool ret = true;
+	int i;
+
+	for (i = 0; i < rp->num_vq_pairs; i++) {
+		struct rpmsg_vq_pair *vqp = &rp->vqp[i];
+
+		spin_lock_irqsave(&vqp->rvq_lock, flags);
+		if (!virtqueue_enable_cb(vqp->rvq))
+			ret = false;
+		spin_unlock_irqrestore(&vqp->rvq_lock, flags);
+	}
+
+	return ret;
+}
+
+static void rpmsg_disable_rx_cb(struct rpmsg_rproc *rp)
+{
+	int i;
+
+	for (i = 0; i < rp->num_vq_pairs; i++)
+		virtqueue_disable_cb(rp->vqp[i].rvq);
+}
+
+/*
+ * Consume up to @budget used RX buffers of a pair. The remote processor is
+ * kicked only once at the end, no matter how many buffers were recycled.
+ * Returns the number of messages that were handled.
+ */
+static int rpmsg_rx_poll_vqp(struct rpmsg_vq_pair *vqp, int budget)
+{
+	struct rpmsg_rproc *rp = vqp->rp;
+	struct rpmsg_hdr *msg;
+	unsigned long flags;
+	int msgs_received = 0;
+	bool recycled = false;
+
+	while (msgs_received < budget && (msg = rpmsg_get_rx_buf(vqp))) {
+		recycled |= rpmsg_recv_single(vqp, msg);
+		msgs_received++;
+	}
+
+	/* tell the remote processor we added more available rx buffers */
+	if (recycled) {
+		spin_lock_irqsave(&vqp->rvq_lock, flags);
+		trace_rpmsg_kick(rp->id, false);
+		virtqueue_kick(vqp->rvq);
+		rpmsg_stat_inc(rp, rx_kicks);
+		spin_unlock_irqrestore(&vqp->rvq_lock, flags);
+	}
+
+	return msgs_received;
+}
+
+/*
+ * Consume up to @budget used RX buffers, from all the pairs. Every pass
+ * starts with the pair that follows the one the previous pass started
+ * with, so a busy pair can't starve the others.
+ *
+ * The priority lane, if there is one, isn't part of the rotation: it is
+ * drained before each of the other pairs, so a high priority message
+ * waits for at most one pair's worth of regular messages.
+ *
+ * Returns the number of messages that were handled.
+ */
+static int rpmsg_rx_poll(struct rpmsg_rproc *rp, int budget)
+{
+	int first = rp->prio_lane ? 1 : 0;
+	int num = rp->num_vq_pairs - first;
+	int i, vqp = rp->rx_next_vqp, msgs_received = 0;
+
+	rp->rx_next_vqp = (vqp + 1) % num;
+
+	for (i = 0; i < num && msgs_received < budget; i++) {
+		if (rp->prio_lane)
+			msgs_received += rpmsg_rx_poll_vqp(&rp->vqp[0],
+						budget - msgs_received);
+
+		msgs_received += rpmsg_rx_poll_vqp(&rp->vqp[first + vqp],
+						budget - msgs_received);
+		vqp = (vqp + 1) % num;
+	}
+
+	if (msgs_received > rp->rx_batch_hwm)
+		rp->rx_batch_hwm = msgs_received;
+
+	return msgs_received;
+}
+
+/*
+ * Inbound messages are handled by a dedicated, per remote processor,
+ * real-time thread, which drains the RX rings of all the vq pairs. Its RX
+ * interrupts are suppressed as long as it is busy draining them, and it
+ * handles at most @rx_budget messages before giving other threads a
+ * chance to run.
+ *
+ * When @rx_busy_poll_us is set, and the last run found messages, the
+ * thread keeps polling the ring for new messages until it has been idle
+ * for that long, before it goes back to sleep waiting for an interrupt.
+ * Under continuous traffic, it still yields once it has polled for
+ * RPMSG_RX_BUSY_POLL_MAX_US, or once a poll used up its whole budget.
+ *
+ * While a reader busy-polls the rings (see rpmsg_busy_poll()), the thread
+ * stays out of its way, and the reader wakes it up once it's done.
+ */
+static int rpmsg_rx_thread(void *data)
+{
+	struct rpmsg_rproc *rp = data;
+	struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO / 2 };
+	ktime_t start, now, idle_since;
+	bool busy;
+	int done;
+
+	sched_setscheduler(current, SCHED_FIFO, &param);
+
+	while (!kthread_should_stop()) {
+		if (test_and_set_bit_lock(0, &rp->rx_owner)) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (test_bit(0, &rp->rx_owner) && !kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+
+		done = rpmsg_rx_poll(rp, rx_budget);
+		if (done == rx_budget) {
+			clear_bit_unlock(0, &rp->rx_owner);
+			cond_resched();
+			continue;
+		}
+
+		/* traffic is flowing; poll for a bit before going to sleep */
+		if (done && rx_busy_poll_us) {
+			start = idle_since = ktime_get();
+			do {
+				cpu_relax();
+				done = rpmsg_rx_poll(rp, rx_budget);
+				now = ktime_get();
+				if (done)
+					idle_since = now;
+				busy = done == rx_budget ||
+					ktime_us_delta(now, start) >=
+						RPMSG_RX_BUSY_POLL_MAX_US;
+			} while (!busy && !kthread_should_stop() &&
+				ktime_us_delta(now, idle_since) <
+							rx_busy_poll_us);
+
+			/* still busy: give other threads a chance, as above */
+			if (busy) {
+				clear_bit_unlock(0, &rp->rx_owner);
+				cond_resched();
+				continue;
+			}
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		/* re-enable RX interrupts, unless new messages just arrived */
+		if (!rpmsg_enable_rx_cb(rp)) {
+			__set_current_state(TASK_RUNNING);
+			rpmsg_disable_rx_cb(rp);
+			clear_bit_unlock(0, &rp->rx_owner);
+			continue;
+		}
+
+		clear_bit_unlock(0, &rp->rx_owner);
+
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+
+	return 0;
+}
+
+/**
+ * rpmsg_busy_poll() - poll for inbound messages in the caller's context
+ * @rpdev: the rpmsg channel
+ * @usecs: max time to poll for, in microseconds
+ * @done: returns true once the caller has what it's waiting for
+ * @data: private data passed to @done
+ *
+ * Even with RX interrupts, an inbound message takes a mailbox interrupt
+ * and a wakeup of the RX thread before it reaches its endpoint. A reader
+ * with a tight latency budget can call this before going to sleep: the
+ * RX interrupts of the remote processor are masked, and the caller spins
+ * on its RX rings, handing any inbound message to its endpoint callback
+ * right away (in the caller's context), until @done returns true, @usecs
+ * have elapsed, or the caller should reschedule.
+ *
+ * If the RX thread is busy draining the rings, the caller just spins on
+ * @done. The RX thread takes over again when this returns.
+ *
+ * Must be called from process context, and with no lock that an endpoint
+ * callback may need. Returns true if @done returned true.
+ */
+bool rpmsg_busy_poll(struct rpmsg_channel *rpdev, unsigned int usecs,
+				bool (*done)(void *data), void *data)
+{
+	struct rpmsg_rproc *rp = rpdev->rp;
+	ktime_t start = ktime_get();
+	bool owner = false, ret;
+
+	while (!(ret = done(data))) {
+		if (need_resched() || signal_pending(current) ||
+				ktime_us_delta(ktime_get(), start) >= usecs)
+			break;
+
+		if (!owner && !test_and_set_bit_lock(0, &rp->rx_owner)) {
+			rpmsg_disable_rx_cb(rp);
+			owner = true;
+		}
+
+		if (owner)
+			rpmsg_rx_poll(rp, rx_budget);
+
+		cpu_relax();
+	}
+
+	/* let the RX thread re-enable the interrupts and wait for them */
+	if (owner) {
+		clear_bit_unlock(0, &rp->rx_owner);
+		wake_up_process(rp->rx_thread);
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(rpmsg_busy_poll);
+
+/*
+ * RX interrupt: hand the work over to the RX thread. there's no need
+ * for more interrupts until it has drained the ring.
+ */
+static void rpmsg_recv_done(struct virtqueue *rvq)
+{
+	struct rpmsg_rproc *rp = rvq->vdev->priv;
+
+	rpmsg_stat_inc(rp, rx_irqs);
+
+	virtqueue_disable_cb(rvq);
+	wake_up_process(rp->rx_thread);
+}
+
+/* the remote processor has consumed a TX buffer; wake up waiting senders */
+static void rpmsg_xmit_done(struct virtqueue *svq)
+{
+	struct rpmsg_rproc *rp = svq->vdev->priv;
+	int i;
+
+	rpmsg_stat_inc(rp, tx_irqs);
+
+	/* vq->priv belongs to the transport, so look the pair up */
+	for (i = 0; i < rp->num_vq_pairs; i++)
+		if (rp->vqp[i].svq == svq)
+			wake_up_interruptible(&rp->vqp[i].sendq);
+}
+
+static int rpmsg_probe(struct virtio_device *vdev)
+{
+	vq_callback_t *callbacks[2 * RPMSG_MAX_VQ_PAIRS];
+	const char *names[2 * RPMSG_MAX_VQ_PAIRS];
+	struct virtqueue *vqs[2 * RPMSG_MAX_VQ_PAIRS];
+	struct rpmsg_rproc *rp;
+	void *addr;
+	int err, i, j, id, num_bufs, buf_size;
+
+	rp = kzalloc(sizeof(*rp), GFP_KERNEL);
+	if (!rp)
+		return -ENOMEM;
+
+	rp->vdev = vdev;
+
+	idr_init(&rp->endpoints);
+	spin_lock_init(&rp->endpoints_lock);
+
+	for (i = 0; i < RPMSG_MAX_VQ_PAIRS; i++) {
+		struct rpmsg_vq_pair *vqp = &rp->vqp[i];
+
+		vqp->rp = rp;
+		spin_lock_init(&vqp->svq_lock);
+		spin_lock_init(&vqp->rvq_lock);
+		init_waitqueue_head(&vqp->sendq);
+		mutex_init(&vqp->frag_lock);
+	}
+
+	rp->stats = alloc_percpu(struct rpmsg_stats);
+	if (!rp->stats) {
+		err = -ENOMEM;
+		goto free_vi;
+	}
+
+	/* platforms that don't say anything have a single pair of vqs */
+	vdev->config->get(vdev, VIRTIO_IPC_NUM_VQ_PAIRS, &rp->num_vq_pairs,
+						sizeof(rp->num_vq_pairs));
+	if (!rp->num_vq_pairs)
+		rp->num_vq_pairs = 1;
+
+	if (rp->num_vq_pairs > RPMSG_MAX_VQ_PAIRS) {
+		dev_err(&vdev->dev, "too many vq pairs: %d\n",
+							rp->num_vq_pairs);
+		err = -EINVAL;
+		goto free_stats;
+	}
+
+	/* We expect pairs of virtqueues, receive then send */
+	for (i = 0; i < rp->num_vq_pairs; i++) {
+		callbacks[2 * i] = rpmsg_recv_done;
+		callbacks[2 * i + 1] = rpmsg_xmit_done;
+		names[2 * i] = "input";
+		names[2 * i + 1] = "output";
+	}
+
+	err = vdev->config->find_vqs(vdev, 2 * rp->num_vq_pairs, vqs,
+							callbacks, names);
+	if (err)
+		goto free_stats;
+
+	for (i = 0; i < rp->num_vq_pairs; i++) {
+		rp->vqp[i].rvq = vqs[2 * i];
+		rp->vqp[i].svq = vqs[2 * i + 1];
+	}
+
+	/* the platform may dedicate the first pair to high priority msgs */
+	vdev->config->get(vdev, VIRTIO_IPC_PRIO_VQ, &rp->prio_lane,
+						sizeof(rp->prio_lane));
+	if (rp->prio_lane && rp->num_vq_pairs < 2) {
+		dev_warn(&vdev->dev, "a priority lane needs 2 vq pairs\n");
+		rp->prio_lane = 0;
+	}
+
+	/* Platform must supply the id of this remote processor device.
+	 * consider changing this to an optional virtio feature */
+	vdev->config->get(vdev, VIRTIO_IPC_PROC_ID, &id, sizeof(id));
+
+	rp->id = id;
+
+	/* Platform must supply pre-allocated uncached buffers for now */
+	vdev->config->get(vdev, VIRTIO_IPC_BUF_ADDR, &addr, sizeof(addr));
+	vdev->config->get(vdev, VIRTIO_IPC_BUF_NUM, &num_bufs,
+							sizeof(num_bufs));
+	vdev->config->get(vdev, VIRTIO_IPC_BUF_SZ, &buf_size, sizeof(buf_size));
+
+	/*
+	 * platforms may size the RX and TX pools differently. those that
+	 * don't say anything get the legacy even split of the buffers.
+	 */
+	vdev->config->get(vdev, VIRTIO_IPC_RX_BUF_NUM, &rp->num_rx_bufs,
+						sizeof(rp->num_rx_bufs));
+	vdev->config->get(vdev, VIRTIO_IPC_TX_BUF_NUM, &rp->num_tx_bufs,
+						sizeof(rp->num_tx_bufs));
+	vdev->config->get(vdev, VIRTIO_IPC_RX_BUF_SZ, &rp->rx_buf_size,
+						sizeof(rp->rx_buf_size));
+	vdev->config->get(vdev, VIRTIO_IPC_TX_BUF_SZ, &rp->tx_buf_size,
+						sizeof(rp->tx_buf_size));
+
+	if (!rp->num_rx_bufs || !rp->num_tx_bufs) {
+		rp->num_rx_bufs = rp->num_tx_bufs = num_bufs / 2;
+		rp->rx_buf_size = rp->tx_buf_size = buf_size;
+	}
+
+	/* if the buffers are mapped cacheable, we must maintain the caches */
+	vdev->config->get(vdev, VIRTIO_IPC_BUF_CACHE_OPS, &rp->cache_ops,
+							sizeof(rp->cache_ops));
+
+	dev_dbg(&vdev->dev, "RX: %d x %d bytes, TX: %d x %d bytes, addr 0x%x\n",
+			rp->num_rx_bufs, rp->rx_buf_size, rp->num_tx_bufs,
+			rp->tx_buf_size, (unsigned int) addr);
+
+	if (rp->rx_buf_size <= sizeof(struct rpmsg_hdr) ||
+			rp->tx_buf_size <= sizeof(struct rpmsg_hdr)) {
+		dev_err(&vdev->dev, "invalid buffer sizes\n");
+		err = -EINVAL;
+		goto del_vqs;
+	}
+
+	/* each pair gets an equal share of the buffers of each direction */
+	if (rp->num_rx_bufs % rp->num_vq_pairs ||
+				rp->num_tx_bufs % rp->num_vq_pairs) {
+		dev_err(&vdev->dev, "can't split buffers between %d vq pairs\n",
+							rp->num_vq_pairs);
+		err = -EINVAL;
+		goto del_vqs;
+	}
+
+	rp->vq_rx_bufs = rp->num_rx_bufs / rp->num_vq_pairs;
+	rp->vq_tx_bufs = rp->num_tx_bufs / rp->num_vq_pairs;
+
+	/* without a priority lane, keep a few buffers for urgent messages */
+	if (!rp->prio_lane)
+		rp->tx_reserve = min_t(int, prio_tx_bufs, rp->vq_tx_bufs / 2);
+
+	/* the TX buffers immediately follow the RX ones */
+	rp->rbufs = addr;
+	rp->sbufs = addr + rp->num_rx_bufs * rp->rx_buf_size;
+
+	/* initially, all TX buffers are free */
+	for (i = 0; i < rp->num_vq_pairs; i++) {
+		struct rpmsg_vq_pair *vqp = &rp->vqp[i];
+		void *sbufs = rp->sbufs + i * rp->vq_tx_bufs * rp->tx_buf_size;
+
+		vqp->tx_pool = kmalloc(rp->vq_tx_bufs * sizeof(void *),
+								GFP_KERNEL);
+		if (!vqp->tx_pool) {
+			err = -ENOMEM;
+			goto free_pool;
+		}
+
+		for (j = 0; j < rp->vq_tx_bufs; j++)
+			vqp->tx_pool[j] = sbufs + j * rp->tx_buf_size;
+		vqp->tx_free = rp->vq_tx_bufs;
+	}
+
+	rp->rx_refs = kcalloc(rp->num_rx_bufs, sizeof(atomic_t), GFP_KERNEL);
+	if (!rp->rx_refs) {
+		err = -ENOMEM;
+		goto free_pool;
+	}
+
+	/* simulated addr base to make virt_to_page happy. consider using
+	 * virtio features for that */
+	vdev->config->get(vdev, VIRTIO_IPC_SIM_BASE, &rp->sim_base,
+							sizeof(rp->sim_base));
+
+	/* set up the receive buffers, each pair gets its own share */
+	for (i = 0; i < rp->num_rx_bufs; i++) {
+		struct scatterlist sg;
+		struct virtqueue *rvq = rp->vqp[i / rp->vq_rx_bufs].rvq;
+		void *tmpaddr = rp->rbufs + i * rp->rx_buf_size;
+		void *simaddr = rp->sim_base + i * rp->rx_buf_size;
+
+		sg_init_one(&sg, simaddr, rp->rx_buf_size);
+		err = virtqueue_add_buf_gfp(rvq, &sg, 0, 1, tmpaddr,
+								GFP_KERNEL);
+		WARN_ON(err < 0); /* sanity check; this can't happen */
+	}
+
+	rp->rx_thread = kthread_run(rpmsg_rx_thread, rp, "rpmsg-rx/%d", id);
+	if (IS_ERR(rp->rx_thread)) {
+		err = PTR_ERR(rp->rx_thread);
+		goto free_refs;
+	}
+
+	/* suppress "tx-complete" interrupts until someone waits for a buffer */
+	for (i = 0; i < rp->num_vq_pairs; i++)
+		virtqueue_disable_cb(rp->vqp[i].svq);
+
+	vdev->priv = rp;
+
+	/* tell the remote processor it can start sending data */
+	for (i = 0; i < rp->num_vq_pairs; i++)
+		virtqueue_kick(rp->vqp[i].rvq);
+
+	rpmsg_debugfs_add(rp);
+
+	dev_info(&vdev->dev, "rpmsg backend dev %d probed successfully\n", id);
+
+	/* manual hack: create rpmsg devices */
+	if (id == 0) {
+		/* loopback: the samples talk to the echo "service" */
+		rp->rpcli = rpmsg_create_channel(rp, "rpmsg-client-sample", RPMSG_ADDR_ANY, RPMSG_LOOPBACK_ECHO_ADDR);
+		rp->rpser = rpmsg_create_channel(rp, "rpmsg-server-sample", 137, RPMSG_ADDR_ANY);
+		rp->rpomx = rpmsg_create_channel(rp, "rpmsg-omx", RPMSG_ADDR_ANY, RPMSG_OMX_ADDR);
+		rp->rpbench = rpmsg_create_channel(rp, "rpmsg-bench", RPMSG_ADDR_ANY, RPMSG_LOOPBACK_ECHO_ADDR);
+	} else if (id == 1) {
+		rp->rpcli = rpmsg_create_channel(rp, "rpmsg-client-sample", RPMSG_ADDR_ANY, 50);
+		rp->rpser = rpmsg_create_channel(rp, "rpmsg-server-sample", 137, RPMSG_ADDR_ANY);
+		rp->rpomx = rpmsg_create_channel(rp, "rpmsg-omx", RPMSG_ADDR_ANY, RPMSG_OMX_ADDR);
+		rp->rpbench = rpmsg_create_channel(rp, "rpmsg-bench", RPMSG_ADDR_ANY, 50);
+	} else if (id == 2) {
+		rp->rpcli = rpmsg_create_channel(rp, "rpmsg-client-sample", RPMSG_ADDR_ANY, 51);
+	}
+
+	return 0;
+
+free_refs:
+	kfree(rp->rx_refs);
+free_pool:
+	for (i = 0; i < rp->num_vq_pairs; i++)
+		kfree(rp->vqp[i].tx_pool);
+del_vqs:
+	vdev->config->del_vqs(vdev);
+free_stats:
+	free_percpu(rp->stats);
+free_vi:
+	kfree(rp);
+	return err;
+}
+
+static void __devexit rpmsg_remove(struct virtio_device *vdev)
 {
 	struct rpmsg_rproc *rp = vdev->priv;
+	int i;
 
 	/* cheap hack */
 	if (rp->id == 0) {
 		rpmsg_destroy_channel(rp->rpcli);
 		rpmsg_destroy_channel(rp->rpser);
 		rpmsg_destroy_channel(rp->rpomx);
-	} else if (rp->id == 1)
+		rpmsg_destroy_channel(rp->rpbench);
+	} else if (rp->id == 1) {
+		rpmsg_destroy_channel(rp->rpcli);
+		rpmsg_destroy_channel(rp->rpser);
+		rpmsg_destroy_channel(rp->rpomx);
+		rpmsg_destroy_channel(rp->rpbench);
+	} else if (rp->id == 2)
 		rpmsg_destroy_channel(rp->rpcli);
 
+	rpmsg_debugfs_remove(rp);
+
+	kthread_stop(rp->rx_thread);
+
 	vdev->config->del_vqs(rp->vdev);
 
+	/* endpoints are freed using RCU; let them go before their rproc */
+	rcu_barrier();
+
 	idr_remove_all(&rp->endpoints);
 	idr_destroy(&rp->endpoints);
+	kfree(rp->rx_refs);
+	for (i = 0; i < rp->num_vq_pairs; i++)
+		kfree(rp->vqp[i].tx_pool);
+	free_percpu(rp->stats);
 	kfree(rp);
 }
 
@@ -389,6 +1788,7 @@ void __exit rpmsg_bus_fini(void);
 static int __init init(void)
 {
 	rpmsg_bus_init(); /* clean me up */
+	rpmsg_debugfs_init();
 	return register_virtio_driver(&virtio_ipc_driver);
 }
 module_init(init);
@@ -396,6 +1796,9 @@ module_init(init);
 static void __exit fini(void)
 {
 	unregister_virtio_driver(&virtio_ipc_driver);
+	/* rpmsg_free_ept() must not run after our text is gone */
+	rcu_barrier();
+	rpmsg_debugfs_fini();
 	rpmsg_bus_fini();
 }
 module_exit(fini);
@@ -3,6 +3,11 @@
 #include <linux/types.h>
 #include <linux/device.h>
 #include <linux/mod_devicetable.h>
+#include <linux/jiffies.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/rcupdate.h>
+#include <linux/uio.h>
 
 /* driver requests */
 enum {
@@ -11,6 +16,50 @@ enum {
 	VIRTIO_IPC_BUF_SZ,
 	VIRTIO_IPC_SIM_BASE,
 	VIRTIO_IPC_PROC_ID, /* processor id 0 is reserved for loopback */
+	VIRTIO_IPC_BUF_CACHE_OPS,
+	VIRTIO_IPC_RX_BUF_NUM,
+	VIRTIO_IPC_TX_BUF_NUM,
+	VIRTIO_IPC_RX_BUF_SZ,
+	VIRTIO_IPC_TX_BUF_SZ,
+	VIRTIO_IPC_NUM_VQ_PAIRS,
+	VIRTIO_IPC_PRIO_VQ, /* non-zero if the first vq pair is a priority lane */
+};
+
+/*
+ * A platform may announce up to this many pairs of RX/TX virtqueues
+ * (in response to VIRTIO_IPC_NUM_VQ_PAIRS). The virtqueues are then
+ * handed to find_vqs() as RX0, TX0, RX1, TX1, ...
+ */
+#define RPMSG_MAX_VQ_PAIRS	(4)
+
+struct virtio_device;
+struct file;
+struct poll_table_struct;
+
+/**
+ * struct rpmsg_frag_state - reassembly of a fragmented inbound message
+ * @buf: reassembly buffer of the fragmented message being received
+ * @len: number of bytes reassembled so far in @buf
+ * @src: source address of the fragmented message being received
+ */
+struct rpmsg_frag_state {
+	void *buf;
+	int len;
+	u32 src;
+};
+
+/**
+ * struct rpmsg_cache_ops - cache maintenance of cacheable message buffers
+ * @clean: write back @len bytes at @va, before the remote processor reads them
+ * @inv: invalidate @len bytes at @va, before reading what the remote wrote
+ *
+ * Platforms that map the message buffers cacheable return these ops in
+ * response to VIRTIO_IPC_BUF_CACHE_OPS. Uncached buffers need no
+ * maintenance, and a NULL is returned instead.
+ */
+struct rpmsg_cache_ops {
+	void (*clean)(struct virtio_device *vdev, void *va, size_t len);
+	void (*inv)(struct virtio_device *vdev, void *va, size_t len);
 };
 
 #define RPMSG_ADDR_ANY		0xFFFFFFFF
@@ -41,21 +90,183 @@ struct rpmsg_channel {
  * @cb:
  * @src: local rpmsg address
  * @priv:
+ * @refcount: the owner holds one reference, and the RX path holds another
+ *	      while it invokes @cb
+ * @released: completed when the last reference is dropped
+ * @rcu: endpoints are looked up locklessly, so they're freed using RCU
+ * @frag: reassembly state, one per pair of virtqueues
+ * @rx_msgs: number of messages delivered to @cb
+ * @rx_bytes: number of payload bytes delivered to @cb
+ * @cb_ns_total: total time spent in @cb
+ * @cb_ns_max: longest time spent in a single invocation of @cb
+ * @tx_msgs: number of messages (or fragments) sent from @addr
+ * @tx_bytes: number of payload bytes sent from @addr
+ * @tx_no_buf: times a sender from @addr found all the TX buffers in use
+ *
+ * The reassembly state and the RX statistics are only ever touched by the
+ * RX thread. The TX statistics are atomic, since the endpoint's users may
+ * send concurrently.
  */
 struct rpmsg_endpoint {
 	struct rpmsg_channel *rpdev;
 	void (*cb)(struct rpmsg_channel *, void *, int, void *, u32);
 	u32 addr;
 	void *priv;
+	atomic_t refcount;
+	struct completion released;
+	struct rcu_head rcu;
+	struct rpmsg_frag_state frag[RPMSG_MAX_VQ_PAIRS];
+	u64 rx_msgs;
+	u64 rx_bytes;
+	u64 cb_ns_total;
+	u64 cb_ns_max;
+	atomic64_t tx_msgs;
+	atomic64_t tx_bytes;
+	atomic64_t tx_no_buf;
 };
 
 struct rpmsg_endpoint *rpmsg_create_ept(struct rpmsg_channel *,
 		void (*cb)(struct rpmsg_channel *, void *, int, void *, u32),
 		void *priv, u32 addr);
 void rpmsg_destroy_ept(struct rpmsg_endpoint *);
-int rpmsg_send(struct rpmsg_channel *rpdev, void *data, int len);
-int rpmsg_sendto(struct rpmsg_channel *rpdev, void *data, int len, u32 dst);
-int rpmsg_send_offchannel(struct rpmsg_channel *, u32, u32, void *, int);
+int rpmsg_send_offchannel_raw(struct rpmsg_channel *, u32, u32, void *, int,
+									long);
+
+/*
+ * rpmsg_send() and friends sleep up to RPMSG_SEND_TIMEOUT if all TX buffers
+ * are in use, until the remote processor returns one. The rpmsg_trysend()
+ * variants never sleep, and fail with -ENOMEM instead.
+ *
+ * Note that the sleeping variants should not be used from an endpoint's
+ * callback: callbacks run in the remote processor's RX thread, so sleeping
+ * there stalls inbound traffic for all the other endpoints too.
+ */
+#define RPMSG_SEND_TIMEOUT	(15 * HZ)
+
+static inline
+int rpmsg_send(struct rpmsg_channel *rpdev, void *data, int len)
+{
+	return rpmsg_send_offchannel_raw(rpdev, rpdev->src, rpdev->dst,
+					data, len, RPMSG_SEND_TIMEOUT);
+}
+
+static inline
+int rpmsg_sendto(struct rpmsg_channel *rpdev, void *data, int len, u32 dst)
+{
+	return rpmsg_send_offchannel_raw(rpdev, rpdev->src, dst, data, len,
+							RPMSG_SEND_TIMEOUT);
+}
+
+static inline
+int rpmsg_send_offchannel(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+							void *data, int len)
+{
+	return rpmsg_send_offchannel_raw(rpdev, src, dst, data, len,
+							RPMSG_SEND_TIMEOUT);
+}
+
+static inline int rpmsg_send_timeout(struct rpmsg_channel *rpdev, void *data,
+						int len, long timeout)
+{
+	return rpmsg_send_offchannel_raw(rpdev, rpdev->src, rpdev->dst,
+						data, len, timeout);
+}
+
+static inline
+int rpmsg_trysend(struct rpmsg_channel *rpdev, void *data, int len)
+{
+	return rpmsg_send_offchannel_raw(rpdev, rpdev->src, rpdev->dst,
+							data, len, 0);
+}
+
+static inline
+int rpmsg_trysendto(struct rpmsg_channel *rpdev, void *data, int len, u32 dst)
+{
+	return rpmsg_send_offchannel_raw(rpdev, rpdev->src, dst, data, len, 0);
+}
+
+static inline
+int rpmsg_trysend_offchannel(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+							void *data, int len)
+{
+	return rpmsg_send_offchannel_raw(rpdev, src, dst, data, len, 0);
+}
+
+/*
+ * High priority messages, e.g. latency-sensitive control messages, get to
+ * overtake bulk traffic. They must fit in a single buffer.
+ */
+int rpmsg_send_offchannel_prio(struct rpmsg_channel *, u32, u32, void *, int,
+									long);
+int rpmsg_get_max_payload(struct rpmsg_channel *rpdev);
+
+static inline
+int rpmsg_send_prio(struct rpmsg_channel *rpdev, void *data, int len)
+{
+	return rpmsg_send_offchannel_prio(rpdev, rpdev->src, rpdev->dst,
+					data, len, RPMSG_SEND_TIMEOUT);
+}
+
+/*
+ * Messages may be up to RPMSG_MAX_MSG_SIZE bytes long. Those that don't fit
+ * in a single buffer are transparently fragmented and reassembled, which
+ * costs a copy on the receiving side, and may sleep on the sending side
+ * (even for the rpmsg_trysend() variants).
+ */
+#define RPMSG_MAX_MSG_SIZE	(64 * 1024)
+
+int rpmsg_sendv_offchannel(struct rpmsg_channel *, u32, u32,
+				const struct kvec *, int, long);
+
+static inline
+int rpmsg_sendv(struct rpmsg_channel *rpdev, const struct kvec *iov,
+								int iovcnt)
+{
+	return rpmsg_sendv_offchannel(rpdev, rpdev->src, rpdev->dst, iov,
+						iovcnt, RPMSG_SEND_TIMEOUT);
+}
+
+/*
+ * Zero-copy sending: reserve a TX buffer, build the payload directly in it,
+ * and then either send it or give it back.
+ */
+void *rpmsg_get_tx_buffer(struct rpmsg_channel *rpdev, u32 src, int *len,
+								long timeout);
+void rpmsg_put_tx_buffer(struct rpmsg_channel *rpdev, void *data);
+int rpmsg_send_offchannel_nocopy(struct rpmsg_channel *, u32, u32, void *, int);
+
+/*
+ * Batching: queue several messages built in TX buffers, then kick the
+ * remote processor once for all of them.
+ */
+int rpmsg_queue_offchannel_nocopy(struct rpmsg_channel *, u32, u32, void *,
+									int);
+void rpmsg_kick(struct rpmsg_channel *rpdev);
+
+/* for the poll() implementation of users that send through a channel */
+bool rpmsg_poll_tx(struct rpmsg_channel *rpdev, u32 src, struct file *filp,
+			struct poll_table_struct *wait, int wanted);
+
+static inline
+int rpmsg_send_nocopy(struct rpmsg_channel *rpdev, void *data, int len)
+{
+	return rpmsg_send_offchannel_nocopy(rpdev, rpdev->src, rpdev->dst,
+								data, len);
+}
+
+/*
+ * By default RX buffers are recycled as soon as the endpoint callback
+ * returns; a callback can hold on to one and release it later instead.
+ */
+int rpmsg_hold_rx_buffer(struct rpmsg_channel *rpdev, void *data);
+void rpmsg_release_rx_buffer(struct rpmsg_channel *rpdev, void *data);
+
+/*
+ * Latency-critical readers may poll for inbound messages themselves for a
+ * short while, rather than wait for an interrupt and the RX thread.
+ */
+bool rpmsg_busy_poll(struct rpmsg_channel *rpdev, unsigned int usecs,
+				bool (*done)(void *data), void *data);
 
 int register_rpmsg_device(struct rpmsg_channel *dev);
 void unregister_rpmsg_device(struct rpmsg_channel *dev);
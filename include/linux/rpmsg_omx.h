@@ -15,16 +15,190 @@
 #ifndef RPMSG_OMX_H
 #define RPMSG_OMX_H
 
+#include <linux/types.h>
 #include <linux/ioctl.h>
 
 #define OMX_IOC_MAGIC	'X'
 
 #define OMX_IOCCONNECT	_IOW(OMX_IOC_MAGIC, 1, char *)
+#define OMX_IOCSENDPRIO	_IOW(OMX_IOC_MAGIC, 2, struct omx_prio_msg)
+/*
+ * a blocking read() polls for up to this many microseconds for an inbound
+ * message, with the remote processor's interrupts masked, before it goes
+ * to sleep. trades cpu time for latency; 0 (the default) disables polling
+ */
+#define OMX_IOCBUSYPOLL	_IOW(OMX_IOC_MAGIC, 3, __u32)
+#define OMX_IOCRINGSETUP _IOWR(OMX_IOC_MAGIC, 4, struct omx_ring_params)
+#define OMX_IOCRINGKICK	_IO(OMX_IOC_MAGIC, 5)
+#define OMX_IOCSENDBATCH _IOWR(OMX_IOC_MAGIC, 6, struct omx_batch)
+#define OMX_IOCRECVBATCH _IOWR(OMX_IOC_MAGIC, 7, struct omx_batch)
+#define OMX_IOCCONNECTV	_IOWR(OMX_IOC_MAGIC, 8, struct omx_connv)
+
+#define OMX_IOC_MAXNR	(8)
 
-#define OMX_IOC_MAXNR	(1)
+/*
+ * OMX_IOCCONNECT on a non-blocking file fails with -EINPROGRESS, and the
+ * connection then completes in the background: poll() reports POLLOUT
+ * once it is established, or POLLERR if the remote refused it, or didn't
+ * respond within a few seconds.
+ */
+
+/*
+ * User pointers are passed as __u64, so that 32-bit and 64-bit userspace
+ * share the same layout.
+ */
 
 struct omx_conn_req {
 	char name[48];
 } __packed;
 
+/**
+ * struct omx_connv_req - an instance to connect with OMX_IOCCONNECTV
+ * @fd:		an open rpmsg-omx file descriptor (i.e. OMX instance)
+ * @status:	returned: 0 if connected, -EINPROGRESS if the connection
+ *		completes in the background, or a negative error code
+ * @name:	the OMX service to connect @fd to
+ */
+struct omx_connv_req {
+	__s32 fd;
+	__s32 status;
+	char name[48];
+};
+
+/**
+ * struct omx_connv - connect several instances at once
+ * @reqs:	pointer to the instances to connect (an array of struct
+ *		omx_connv_req)
+ * @count:	number of entries in @reqs (at most 64)
+ * @reserved:	should be zero
+ *
+ * All the connection requests are sent before any response is waited for,
+ * so connecting many instances takes a single round trip. If the file the
+ * ioctl is issued on is non-blocking, the responses aren't waited for at
+ * all, as with OMX_IOCCONNECT.
+ */
+struct omx_connv {
+	__u64 reqs;
+	__u32 count;
+	__u32 reserved;
+};
+
+/**
+ * struct omx_prio_msg - a message to send with OMX_IOCSENDPRIO
+ * @data:	pointer to the message
+ * @len:	length of @data (in bytes), which must fit in a single rpmsg
+ *		buffer
+ * @reserved:	should be zero
+ *
+ * Unlike messages that are write()n, these are sent with high priority,
+ * so they don't have to wait behind the bulk data that was already sent.
+ * This is meant for latency-sensitive commands, e.g. pause or flush.
+ */
+struct omx_prio_msg {
+	__u64 data;
+	__u32 len;
+	__u32 reserved;
+};
+
+/**
+ * struct omx_batch_msg - a message of an OMX_IOC{SEND,RECV}BATCH call
+ * @data:	pointer to the message, or to where to receive it
+ * @len:	length of @data (in bytes)
+ * @status:	returned: 0 if the message was sent, or the length of the
+ *		message that was received (more than @len if it had to be
+ *		truncated), or a negative error code
+ */
+struct omx_batch_msg {
+	__u64 data;
+	__u32 len;
+	__s32 status;
+};
+
+/**
+ * struct omx_batch - an array of messages to send or receive in one call
+ * @msgs:	pointer to the messages (an array of struct omx_batch_msg)
+ * @count:	number of entries in @msgs (at most 64)
+ * @reserved:	should be zero
+ *
+ * All the messages are sent with a single kick of the remote processor.
+ * When receiving, only the first message is waited for. The call stops
+ * at the first message that fails, and returns the number of messages
+ * that were sent or received.
+ */
+struct omx_batch {
+	__u64 msgs;
+	__u32 count;
+	__u32 reserved;
+};
+
+/*
+ * Shared rings: instead of a syscall per message, an OMX instance can set
+ * up a submission ring (SQ) and a completion ring (CQ) with
+ * OMX_IOCRINGSETUP, and mmap() them.
+ *
+ * Userspace queues outbound messages in the SQ and then issues a single
+ * OMX_IOCRINGKICK, which sends all of them. Entries with an invalid @len
+ * are flagged and skipped, rather than holding up the rest of the SQ.
+ * Inbound messages are placed in the CQ, and poll() reports POLLIN while
+ * it isn't empty. Inbound messages that are too large for a CQ entry are
+ * still queued for read().
+ *
+ * Both rings use free running indices: the producer only ever writes
+ * @tail, the consumer only ever writes @head, and the ring is empty when
+ * they are equal. Entry i lives at (i & (entries - 1)) * entry_size bytes
+ * past the ring's @entries.
+ */
+
+/**
+ * struct omx_ring_params - parameters of OMX_IOCRINGSETUP
+ * @sq_entries:	number of SQ entries (power of 2)
+ * @cq_entries:	number of CQ entries (power of 2)
+ * @entry_size:	size of each entry, struct omx_ring_entry included
+ *		(power of 2). an entry may not be larger than what a single
+ *		message can carry, struct omx_ring_entry included
+ * @sq_off:	returned: offset of the SQ's struct omx_ring in the mapping
+ * @cq_off:	returned: offset of the CQ's struct omx_ring in the mapping
+ * @size:	returned: size of the mapping
+ */
+struct omx_ring_params {
+	__u32 sq_entries;
+	__u32 cq_entries;
+	__u32 entry_size;
+	__u32 sq_off;
+	__u32 cq_off;
+	__u32 size;
+};
+
+/**
+ * struct omx_ring - a shared ring
+ * @head:	consumer index
+ * @tail:	producer index
+ * @dropped:	CQ only: messages lost because the CQ was full
+ * @entries:	the ring entries
+ */
+struct omx_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 dropped;
+	__u32 reserved;
+	char entries[0];
+};
+
+/* set in an SQ entry that was skipped by OMX_IOCRINGKICK because its
+ * @len was invalid */
+#define OMX_RING_F_INVALID	(1 << 0)
+
+/**
+ * struct omx_ring_entry - a message in a shared ring
+ * @len:	length of @data (in bytes)
+ * @flags:	SQ only: written by the kernel once it's done with the entry,
+ *		either zero or OMX_RING_F_INVALID
+ * @data:	the message
+ */
+struct omx_ring_entry {
+	__u32 len;
+	__u32 flags;
+	char data[0];
+};
+
 #endif /* RPMSG_OMX_H */
@@ -0,0 +1,188 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rpmsg
+
+#if !defined(_TRACE_RPMSG_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_RPMSG_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+/*
+ * The life of a message, as seen by these events:
+ *
+ * rpmsg_send -> rpmsg_kick -> rpmsg_mbox_tx -> (remote processor) ->
+ * rpmsg_mbox_rx -> rpmsg_recv -> rpmsg_cb_entry -> rpmsg_cb_exit
+ *
+ * When the rpmsg_virtio 'timestamp' parameter is set, outgoing messages
+ * carry the (truncated) monotonic time at which they were sent, and
+ * rpmsg_recv reports how old an inbound message is. For messages that
+ * were echoed back by the remote processor, this is the round-trip time.
+ */
+
+DECLARE_EVENT_CLASS(rpmsg_msg,
+
+	TP_PROTO(int rproc, u32 src, u32 dst, u16 len, u16 flags, u32 ts),
+
+	TP_ARGS(rproc, src, dst, len, flags, ts),
+
+	TP_STRUCT__entry(
+		__field(	int,	rproc	)
+		__field(	u32,	src	)
+		__field(	u32,	dst	)
+		__field(	u16,	len	)
+		__field(	u16,	flags	)
+		__field(	u32,	ts	)
+	),
+
+	TP_fast_assign(
+		__entry->rproc	= rproc;
+		__entry->src	= src;
+		__entry->dst	= dst;
+		__entry->len	= len;
+		__entry->flags	= flags;
+		__entry->ts	= ts;
+	),
+
+	TP_printk("rproc=%d src=0x%x dst=0x%x len=%u flags=0x%x ts=%u",
+		__entry->rproc, __entry->src, __entry->dst, __entry->len,
+		__entry->flags, __entry->ts)
+);
+
+DEFINE_EVENT(rpmsg_msg, rpmsg_send,
+
+	TP_PROTO(int rproc, u32 src, u32 dst, u16 len, u16 flags, u32 ts),
+
+	TP_ARGS(rproc, src, dst, len, flags, ts)
+);
+
+TRACE_EVENT(rpmsg_recv,
+
+	TP_PROTO(int rproc, u32 src, u32 dst, u16 len, u16 flags, u32 ts,
+								u32 age_ns),
+
+	TP_ARGS(rproc, src, dst, len, flags, ts, age_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	rproc	)
+		__field(	u32,	src	)
+		__field(	u32,	dst	)
+		__field(	u16,	len	)
+		__field(	u16,	flags	)
+		__field(	u32,	ts	)
+		__field(	u32,	age_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->rproc	= rproc;
+		__entry->src	= src;
+		__entry->dst	= dst;
+		__entry->len	= len;
+		__entry->flags	= flags;
+		__entry->ts	= ts;
+		__entry->age_ns	= age_ns;
+	),
+
+	TP_printk("rproc=%d src=0x%x dst=0x%x len=%u flags=0x%x ts=%u age_ns=%u",
+		__entry->rproc, __entry->src, __entry->dst, __entry->len,
+		__entry->flags, __entry->ts, __entry->age_ns)
+);
+
+TRACE_EVENT(rpmsg_kick,
+
+	TP_PROTO(int rproc, bool tx),
+
+	TP_ARGS(rproc, tx),
+
+	TP_STRUCT__entry(
+		__field(	int,	rproc	)
+		__field(	bool,	tx	)
+	),
+
+	TP_fast_assign(
+		__entry->rproc	= rproc;
+		__entry->tx	= tx;
+	),
+
+	TP_printk("rproc=%d vq=%s", __entry->rproc,
+		__entry->tx ? "tx" : "rx")
+);
+
+DECLARE_EVENT_CLASS(rpmsg_mbox,
+
+	TP_PROTO(const char *name, u32 msg),
+
+	TP_ARGS(name, msg),
+
+	TP_STRUCT__entry(
+		__string(	name,	name	)
+		__field(	u32,	msg	)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->msg	= msg;
+	),
+
+	TP_printk("%s msg=0x%x", __get_str(name), __entry->msg)
+);
+
+DEFINE_EVENT(rpmsg_mbox, rpmsg_mbox_tx,
+
+	TP_PROTO(const char *name, u32 msg),
+
+	TP_ARGS(name, msg)
+);
+
+DEFINE_EVENT(rpmsg_mbox, rpmsg_mbox_rx,
+
+	TP_PROTO(const char *name, u32 msg),
+
+	TP_ARGS(name, msg)
+);
+
+TRACE_EVENT(rpmsg_cb_entry,
+
+	TP_PROTO(u32 addr, u32 src, int len),
+
+	TP_ARGS(addr, src, len),
+
+	TP_STRUCT__entry(
+		__field(	u32,	addr	)
+		__field(	u32,	src	)
+		__field(	int,	len	)
+	),
+
+	TP_fast_assign(
+		__entry->addr	= addr;
+		__entry->src	= src;
+		__entry->len	= len;
+	),
+
+	TP_printk("ept=0x%x src=0x%x len=%d", __entry->addr, __entry->src,
+		__entry->len)
+);
+
+TRACE_EVENT(rpmsg_cb_exit,
+
+	TP_PROTO(u32 addr, u64 duration_ns),
+
+	TP_ARGS(addr, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(	u32,	addr		)
+		__field(	u64,	duration_ns	)
+	),
+
+	TP_fast_assign(
+		__entry->addr		= addr;
+		__entry->duration_ns	= duration_ns;
+	),
+
+	TP_printk("ept=0x%x duration_ns=%llu", __entry->addr,
+		(unsigned long long) __entry->duration_ns)
+);
+
+#endif /* _TRACE_RPMSG_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>